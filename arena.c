@@ -0,0 +1,120 @@
+#include "quackcc.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// The arena that allocate() takes memory from on this thread.
+_Thread_local Arena *current_arena;
+
+static ArenaBlock *create_block(Arena *arena, size_t size) {
+  // reuse a block kept by arena_reset() if it is large enough
+  for (ArenaBlock **p = &arena->spare; *p; p = &(*p)->next) {
+    ArenaBlock *block = *p;
+    if (block->size < size) continue;
+    *p = block->next;
+    block->next = NULL;
+    block->used = 0;
+    return block;
+  }
+
+  if (size < ARENA_BLOCK_SIZE) size = ARENA_BLOCK_SIZE;
+  ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+  if (!block) error("out of memory");
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+  return block;
+}
+
+// Returns zero-initialised memory that lives as long as the current arena.
+// Without an arena, this falls back to the heap.
+void *allocate(size_t size) {
+  Arena *arena = current_arena;
+  if (!arena) {
+    void *ptr = calloc(1, size);
+    if (!ptr) error("out of memory");
+    return ptr;
+  }
+
+  size = (size + 15) & ~(size_t)15;
+
+  ArenaBlock *block = arena->head;
+  if (!block || block->size - block->used < size) {
+    block = create_block(arena, size);
+    block->next = arena->head;
+    arena->head = block;
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  arena->allocated += size;
+  memset(ptr, 0, size);
+  return ptr;
+}
+
+char *copy_string(char *s, int len) {
+  char *copy = allocate(len + 1);
+  memcpy(copy, s, len);
+  return copy;
+}
+
+// Moves all memory of `src` into `dst`.
+void arena_merge(Arena *dst, Arena *src) {
+  if (!src->head) return;
+
+  ArenaBlock *last = src->head;
+  while (last->next) last = last->next;
+  last->next = dst->head;
+  dst->head = src->head;
+  dst->allocated += src->allocated;
+
+  src->head = NULL;
+  src->allocated = 0;
+}
+
+// Releases everything allocated from `arena`, but keeps its blocks around
+// for the allocations that follow.
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->head;
+  while (block) {
+    ArenaBlock *next = block->next;
+    block->next = arena->spare;
+    arena->spare = block;
+    block = next;
+  }
+  arena->head = NULL;
+  arena->allocated = 0;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+  return (ArenaMark){
+    arena->head, arena->head ? arena->head->used : 0, arena->allocated};
+}
+
+// Releases everything allocated from `arena` since `mark` was taken. Blocks
+// started since then are kept for reuse, as by arena_reset().
+void arena_release(Arena *arena, ArenaMark mark) {
+  while (arena->head != mark.head) {
+    ArenaBlock *block = arena->head;
+    arena->head = block->next;
+    block->next = arena->spare;
+    arena->spare = block;
+  }
+  if (arena->head) arena->head->used = mark.used;
+  arena->allocated = mark.allocated;
+}
+
+static void free_blocks(ArenaBlock *block) {
+  while (block) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
+  }
+}
+
+void arena_free(Arena *arena) {
+  free_blocks(arena->head);
+  free_blocks(arena->spare);
+  arena->head = NULL;
+  arena->spare = NULL;
+  arena->allocated = 0;
+}
@@ -0,0 +1,82 @@
+#!/bin/bash
+# Compile-throughput benchmark. Generates synthetic programs of growing
+# size with bench/gen, compiles each one with -ftime-report -fmem-report
+# and prints throughput per phase.
+#
+# BENCH_SCALE multiplies the program sizes (default 1).
+
+cd "$(dirname "$0")/.."
+
+QUACKCC=${QUACKCC:-./quackcc}
+GEN=./bench/gen
+SCALE=${BENCH_SCALE:-1}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# shape and base size of every benchmark
+BENCHES="
+functions 1000
+functions 5000
+locals 1000
+locals 5000
+nested 1000
+nested 5000
+stmts 5000
+stmts 20000
+arrays 1000
+arrays 5000
+"
+
+# value of the line `  <key> <value>` in the report
+field() {
+  awk -v key="$1" '$1 == key { print $2; exit }' "$2"
+}
+
+# value of `<key>` within the "<section>:" block of the report
+section_field() {
+  awk -v section="$1" -v key="$2" '
+    $0 ~ "^  " section ":" { inside = 1; next }
+    inside && $0 !~ /^    / { inside = 0 }
+    inside && $1 == key { print $2; exit }' "$3"
+}
+
+rate() {
+  awk -v n="$1" -v ms="$2" 'BEGIN { if (ms > 0) printf "%.0f", n / ms * 1000; else print "-" }'
+}
+
+printf "%-10s %7s %9s %9s %11s %11s %11s %9s %9s %9s %9s\n" \
+  benchmark size input_kb total_ms tokens/s nodes/s asm_B/s \
+  tok_rss parse_rss cg_rss peak_rss
+echo "$BENCHES" | while read -r shape size; do
+  [ -z "$shape" ] && continue
+  size=$((size * SCALE))
+
+  "$GEN" "$shape" "$size" > "$TMP/in.c" || exit 1
+  if ! "$QUACKCC" -j1 -ftime-report -fmem-report - < "$TMP/in.c" \
+      > "$TMP/out.s" 2> "$TMP/report"; then
+    echo "$shape $size: compile failed:"
+    head -c 500 "$TMP/report"
+    continue
+  fi
+
+  r="$TMP/report"
+  tokens=$(field tokens "$r")
+  nodes=$(field nodes "$r")
+  asm_bytes=$(awk '$1 == "output" && $2 == "bytes" { print $3 }' "$r")
+  tokenise_ms=$(field tokenise "$r")
+  parse_ms=$(awk '$1 == "parse" || $1 == "add_type" { s += $2 } /memory report/ { print s; exit }' "$r")
+  codegen_ms=$(field codegen "$r")
+  total_ms=$(field total "$r")
+  kb=$(( $(wc -c < "$TMP/in.c") / 1024 ))
+  mb() { awk -v b="$1" 'BEGIN { printf "%.1fM", b / 1048576 }'; }
+
+  printf "%-10s %7d %9d %9.2f %11s %11s %11s %9s %9s %9s %9s\n" \
+    "$shape" "$size" "$kb" "$total_ms" \
+    "$(rate "$tokens" "$tokenise_ms")" \
+    "$(rate "$nodes" "$parse_ms")" \
+    "$(rate "$asm_bytes" "$codegen_ms")" \
+    "$(mb "$(section_field "peak RSS after phase" tokenise "$r")")" \
+    "$(mb "$(section_field "peak RSS after phase" parse "$r")")" \
+    "$(mb "$(section_field "peak RSS after phase" codegen "$r")")" \
+    "$(mb "$(awk '$1 == "peak" && $2 == "RSS" && NF == 3 { print $3 }' "$r")")"
+done
@@ -0,0 +1,89 @@
+// Generates synthetic programs for the compile-throughput benchmark.
+//
+//   gen <shape> <size>
+//
+// shapes:
+//   functions  <size> small functions and a main calling them
+//   locals     one function with <size> local variables
+//   nested     one expression nested <size> levels deep
+//   stmts      one function with <size> statements
+//   arrays     <size> two-dimensional array declarations and accesses
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void functions(int n) {
+  for (int i = 0; i < n; i++) {
+    printf("int f%d(int x, int y) {\n", i);
+    printf("  int a = x + %d, b = y * 2, *p = &a;\n", i);
+    printf("  if (a > b) a = a - b; else b = b - a;\n");
+    printf("  while (b > 0) { *p = *p + b; b = b - 1; }\n");
+    printf("  return a + b;\n");
+    printf("}\n");
+  }
+  printf("int main() {\n  int s = 0;\n");
+  for (int i = 0; i < n; i++) printf("  s = s + f%d(s, %d);\n", i, i);
+  printf("  return s;\n}\n");
+}
+
+static void locals(int n) {
+  printf("int main() {\n");
+  for (int i = 0; i < n; i++) printf("  int v%d = %d;\n", i, i % 100);
+  printf("  int s = 0;\n");
+  for (int i = 0; i < n; i++) printf("  s = s + v%d * v%d;\n", i, n - 1 - i);
+  printf("  return s;\n}\n");
+}
+
+static void nested(int n) {
+  static char ops[] = "+-*+";
+  printf("int main() {\n  int x = 3;\n  return ");
+  for (int i = 0; i < n; i++) printf("(x %c ", ops[i % 4]);
+  printf("1");
+  for (int i = 0; i < n; i++) printf(")");
+  printf(";\n}\n");
+}
+
+static void stmts(int n) {
+  printf("int main() {\n  int x = 0, y = 1, z = 2;\n");
+  for (int i = 0; i < n; i++) {
+    switch (i % 4) {
+    case 0: printf("  x = x + y * %d;\n", i % 7); break;
+    case 1: printf("  if (x > z) y = y + 1;\n"); break;
+    case 2: printf("  z = (x - y) / 3 + z;\n"); break;
+    case 3: printf("  for (y = 0; y < 3; y = y + 1) x = x - 1;\n"); break;
+    }
+  }
+  printf("  return x + y + z;\n}\n");
+}
+
+static void arrays(int n) {
+  printf("int main() {\n");
+  for (int i = 0; i < n; i++) printf("  int a%d[8][16];\n", i);
+  for (int i = 0; i < n; i++)
+    printf("  a%d[%d][%d] = %d;\n", i, i % 8, i % 16, i);
+  printf("  return a0[0][0]");
+  for (int i = 1; i < n && i < 64; i++) printf(" + a%d[%d][%d]", i, i % 8, i % 16);
+  printf(";\n}\n");
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s <shape> <size>\n", argv[0]);
+    return 1;
+  }
+
+  char *shape = argv[1];
+  int n = atoi(argv[2]);
+
+  if (strcmp(shape, "functions") == 0) functions(n);
+  else if (strcmp(shape, "locals") == 0) locals(n);
+  else if (strcmp(shape, "nested") == 0) nested(n);
+  else if (strcmp(shape, "stmts") == 0) stmts(n);
+  else if (strcmp(shape, "arrays") == 0) arrays(n);
+  else {
+    fprintf(stderr, "%s: unknown shape: %s\n", argv[0], shape);
+    return 1;
+  }
+  return 0;
+}
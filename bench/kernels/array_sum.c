@@ -0,0 +1,15 @@
+int main() {
+  int a[1000];
+  int i;
+  int r;
+  int sum;
+
+  for (i = 0; i < 1000; i = i + 1) a[i] = i - i / 7 * 7;
+
+  sum = 0;
+  for (r = 0; r < 2000; r = r + 1) {
+    for (i = 0; i < 1000; i = i + 1) sum = sum + a[i];
+    sum = sum - sum / 251 * 251;
+  }
+  return sum;
+}
@@ -0,0 +1,14 @@
+int add(int a, int b) { return a + b; }
+int mix(int a, int b, int c) { return add(a, b) + add(b, c) - b; }
+
+int main() {
+  int i;
+  int sum;
+
+  sum = 0;
+  for (i = 0; i < 200000; i = i + 1) {
+    sum = mix(sum, i, 3);
+    sum = sum - sum / 1009 * 1009;
+  }
+  return sum - sum / 251 * 251;
+}
@@ -0,0 +1,28 @@
+int main() {
+  int x[48][48];
+  int y[48][48];
+  int z[48][48];
+  int i;
+  int j;
+  int k;
+  int r;
+  int sum;
+
+  for (i = 0; i < 48; i = i + 1)
+    for (j = 0; j < 48; j = j + 1) {
+      x[i][j] = i + j - (i + j) / 5 * 5;
+      y[i][j] = i - j + 48;
+    }
+
+  for (r = 0; r < 10; r = r + 1)
+    for (i = 0; i < 48; i = i + 1)
+      for (j = 0; j < 48; j = j + 1) {
+        sum = 0;
+        for (k = 0; k < 48; k = k + 1) sum = sum + x[i][k] * y[k][j];
+        z[i][j] = sum;
+      }
+
+  sum = 0;
+  for (i = 0; i < 48; i = i + 1) sum = sum + z[i][i];
+  return sum - sum / 251 * 251;
+}
@@ -0,0 +1,17 @@
+int main() {
+  int next[1024];
+  int *p;
+  int i;
+  int sum;
+
+  for (i = 0; i < 1024; i = i + 1) next[i] = (i * 389 + 1) - (i * 389 + 1) / 1024 * 1024;
+
+  p = next;
+  i = 0;
+  sum = 0;
+  while (sum < 2000000) {
+    i = *(p + i);
+    sum = sum + i;
+  }
+  return i - i / 251 * 251;
+}
@@ -0,0 +1,126 @@
+#!/bin/bash
+# Generated-code benchmark. Compiles every kernel in bench/kernels with
+# quackcc and with the system C compiler at -O0 and -O2, runs the three
+# binaries, and compares their runtime, instruction count and code size.
+#
+# kernels:
+#   array_sum      sums an array over and over
+#   matmul         multiplies two int x[N][N] matrices
+#   fib            naive recursive Fibonacci
+#   pointer_chase  follows a chain of links through a pointer
+#   calls          many calls to small functions
+#
+# Every kernel returns a checksum as its exit status, and the binaries must
+# agree on it.
+#
+# environment:
+#   CC        compiler for the target, used to assemble quackcc's output
+#             and as the baseline (default: cc)
+#   RUN       prefix to run target binaries with, e.g. "qemu-aarch64 -L
+#             /usr/aarch64-linux-gnu" when cross compiling (default: none)
+#   QEMU_INSN path to qemu's libinsn.so plugin; with RUN set to qemu, counts
+#             instructions with it
+#   REPEAT    runs per binary; the fastest one is reported (default: 3)
+
+cd "$(dirname "$0")/.."
+
+QUACKCC=${QUACKCC:-./quackcc}
+CC=${CC:-cc}
+RUN=${RUN:-}
+REPEAT=${REPEAT:-3}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now_ns() {
+  local t=$(date +%s%N)
+  case "$t" in
+  *N) perl -MTime::HiRes=time -e 'printf "%.0f\n", time() * 1e9' ;;
+  *) echo "$t" ;;
+  esac
+}
+
+# runs a binary REPEAT times; prints "<exit status> <best time in ms>"
+run() {
+  local best= status=
+  for ((n = 0; n < REPEAT; n++)); do
+    local start=$(now_ns)
+    $RUN "$1" > /dev/null
+    status=$?
+    local ns=$(( $(now_ns) - start ))
+    if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then best=$ns; fi
+  done
+  awk -v s="$status" -v ns="$best" 'BEGIN { printf "%d %.2f\n", s, ns / 1e6 }'
+}
+
+# prints the number of user-space instructions executed by a binary, or "-"
+count_insns() {
+  if [ -n "$RUN" ] && [ -n "$QEMU_INSN" ]; then
+    $RUN -plugin "$QEMU_INSN" -d plugin "$1" 2>&1 >/dev/null |
+      awk '/insns:/ { print $2; found = 1 } END { if (!found) print "-" }'
+  elif [ -z "$RUN" ] && command -v perf > /dev/null; then
+    perf stat -x, -e instructions:u "$1" 2>&1 >/dev/null |
+      awk -F, '/instructions/ { print ($1 ~ /^[0-9]+$/) ? $1 : "-"; found = 1 }
+               END { if (!found) print "-" }'
+  else
+    echo -
+  fi
+}
+
+# prints the size of the text section of an object file
+text_size() {
+  size "$1" 2>/dev/null | awk 'NR == 2 { print $1 }'
+}
+
+ratio() {
+  awk -v a="$1" -v b="$2" 'BEGIN {
+    if (a ~ /^[0-9.]+$/ && b ~ /^[0-9.]+$/ && b > 0) printf "%.2f", a / b
+    else print "-"
+  }'
+}
+
+printf "%-14s %10s %10s %10s %8s %8s %12s %12s %8s %8s %8s\n" \
+  kernel qcc_ms O0_ms O2_ms qcc/O0 qcc/O2 qcc_insns O2_insns qcc_text \
+  O2_text text/O2
+
+status=0
+for src in bench/kernels/*.c; do
+  name=$(basename "$src" .c)
+
+  if ! "$QUACKCC" - < "$src" > "$TMP/$name.s"; then
+    echo "$name: quackcc failed"
+    status=1
+    continue
+  fi
+  $CC -c -o "$TMP/$name.qcc.o" "$TMP/$name.s" &&
+  $CC -o "$TMP/$name.qcc" "$TMP/$name.qcc.o" &&
+  $CC -O0 -w -c -o "$TMP/$name.O0.o" "$src" &&
+  $CC -O0 -o "$TMP/$name.O0" "$TMP/$name.O0.o" &&
+  $CC -O2 -w -c -o "$TMP/$name.O2.o" "$src" &&
+  $CC -O2 -o "$TMP/$name.O2" "$TMP/$name.O2.o" || {
+    echo "$name: build failed"
+    status=1
+    continue
+  }
+
+  read -r qcc_status qcc_ms < <(run "$TMP/$name.qcc")
+  read -r o0_status o0_ms < <(run "$TMP/$name.O0")
+  read -r o2_status o2_ms < <(run "$TMP/$name.O2")
+
+  if [ "$qcc_status" != "$o0_status" ] || [ "$qcc_status" != "$o2_status" ]; then
+    echo "$name: checksum mismatch: quackcc $qcc_status, -O0 $o0_status, -O2 $o2_status"
+    status=1
+  fi
+
+  qcc_insns=$(count_insns "$TMP/$name.qcc")
+  o2_insns=$(count_insns "$TMP/$name.O2")
+  qcc_text=$(text_size "$TMP/$name.qcc.o")
+  o2_text=$(text_size "$TMP/$name.O2.o")
+
+  printf "%-14s %10s %10s %10s %8s %8s %12s %12s %8s %8s %8s\n" \
+    "$name" "$qcc_ms" "$o0_ms" "$o2_ms" \
+    "$(ratio "$qcc_ms" "$o0_ms")" "$(ratio "$qcc_ms" "$o2_ms")" \
+    "$qcc_insns" "$o2_insns" "$qcc_text" "$o2_text" \
+    "$(ratio "$qcc_text" "$o2_text")"
+done
+
+exit $status
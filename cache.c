@@ -0,0 +1,110 @@
+#include "quackcc.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk cache of generated code, one file per function.
+//
+// A function only depends on its own tokens: locals are declared in the
+// body and calls are not checked against other functions. So its assembly
+// is keyed by a hash of its tokens plus the compiler version and the
+// options that affect code generation, and can be spliced into the output
+// of any program containing the same function.
+
+// FNV-1a
+uint64_t hash_bytes(uint64_t h, char *p, int len) {
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)p[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+// Returns the token after the closing brace of the function definition
+// starting at `start`, or NULL if it is not well formed. Such functions
+// are left for the parser to report.
+Token *skip_function(Token *start) {
+  Token *token = start;
+  while (token->kind != TK_EOF && !equal(token, "{")) token = token->next;
+  if (token->kind == TK_EOF) return NULL;
+
+  int level = 0;
+  for (; token->kind != TK_EOF; token = token->next) {
+    if (equal(token, "{")) level++;
+    if (equal(token, "}") && --level == 0) return token->next;
+  }
+  return NULL;
+}
+
+// Returns the cache key of the tokens from `start` up to (excluding) `end`.
+char *cache_key(Token *start, Token *end) {
+  char *fingerprint = options_fingerprint();
+
+  uint64_t h = FNV_OFFSET;
+  h = hash_bytes(h, QUACKCC_VERSION, sizeof(QUACKCC_VERSION));
+  h = hash_bytes(h, fingerprint, strlen(fingerprint) + 1);
+  for (Token *token = start; token != end; token = token->next) {
+    h = hash_bytes(h, (char *)&token->kind, sizeof(token->kind));
+    h = hash_bytes(h, (char *)&token->len, sizeof(token->len));
+    h = hash_bytes(h, token->loc, token->len);
+    // instrumented code, and code laid out by a profile, depends on source
+    // positions
+    if (opt->instrument || opt->profile) {
+      h = hash_bytes(h, (char *)&token->line, sizeof(token->line));
+      h = hash_bytes(h, (char *)&token->col, sizeof(token->col));
+    }
+  }
+
+  char *key = allocate(17);
+  snprintf(key, 17, "%016llx", (unsigned long long)h);
+  return key;
+}
+
+static char *entry_path(char *key) {
+  int len = snprintf(NULL, 0, "%s/%s.s", opt->cache_dir, key) + 1;
+  char *path = allocate(len);
+  snprintf(path, len, "%s/%s.s", opt->cache_dir, key);
+  return path;
+}
+
+// Reads the cached code for `key` into the current arena. Returns NULL on a
+// miss.
+char *cache_lookup(char *key, size_t *len) {
+  FILE *fp = fopen(entry_path(key), "r");
+  if (!fp) return NULL;
+
+  char *buf = NULL;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    long size = ftell(fp);
+    if (size >= 0 && fseek(fp, 0, SEEK_SET) == 0) {
+      buf = allocate(size + 1);
+      if (fread(buf, 1, size, fp) == (size_t)size) *len = size;
+      else buf = NULL;
+    }
+  }
+
+  fclose(fp);
+  return buf;
+}
+
+// Stores the code for `key`. The entry is written to a temporary file and
+// renamed into place, so concurrent compilers never see a partial entry.
+// Failures are ignored; the cache is only an optimisation.
+void cache_store(char *key, char *buf, size_t len) {
+  if (mkdir(opt->cache_dir, 0777) && errno != EEXIST) return;
+
+  char *path = entry_path(key);
+  int tmp_len = strlen(path) + 64;
+  char *tmp = allocate(tmp_len);
+  snprintf(tmp, tmp_len, "%s.%ld.%lx.tmp", path, (long)getpid(),
+           (unsigned long)pthread_self());
+
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) return;
+  bool ok = fwrite(buf, 1, len, fp) == len;
+  ok = fclose(fp) == 0 && ok;
+
+  if (!ok || rename(tmp, path)) unlink(tmp);
+}
@@ -0,0 +1,479 @@
+#include "quackcc.h"
+
+// Control-flow simplification
+//
+// Statements are generated one at a time, each with labels and branches of
+// its own, so nested ones leave branches to branches, branches to the next
+// instruction, code no branch reaches and labels nothing jumps to. After a
+// function is generated, its code is simplified by repeating, until nothing
+// changes:
+//
+//   - jump threading: a branch to an unconditional branch goes to its
+//     target instead, and one to a conditional branch whose outcome is
+//     known there goes to where that one continues. The outcome is known
+//     when both test the same flags or register, or when the register was
+//     just set to a constant.
+//   - a branch to the next instruction is removed, and a conditional branch
+//     over an unconditional one is inverted to take its place
+//   - a block only reached by an unconditional branch, and not from the
+//     instruction before it, is moved to replace the branch, so that it
+//     runs straight on from the block before it
+//   - instructions after an unconditional branch, up to the next label,
+//     are never run and removed
+//   - labels nothing branches to are removed, merging the blocks around
+//     them
+//
+// Like the scheduler, the pass works on the generated text. Only the .L
+// labels are local to the function, and one referred to by anything but a
+// branch, such as a jump table or a profile record, stays where it is.
+
+// rounds of simplification after which the code is left as it is, in case
+// branches to each other keep being threaded around a loop
+#define MAX_ROUNDS 8
+
+typedef enum {
+  LINE_INSN,      // an instruction falling through to the next line
+  LINE_DIRECTIVE, // anything which is not an instruction or a label
+  LINE_LABEL,
+  LINE_JUMP,   // b to a label
+  LINE_BRANCH, // b<cond>, cbz or cbnz to a label
+  LINE_EXIT,   // ret, br or b out of the function
+} LineKind;
+
+typedef struct {
+  LineKind kind;
+  char *text;
+  int len;
+  // the label defined, or branched to
+  int label;
+  // the condition of a branch, and the register cbz and cbnz test, or -1
+  // for the flags
+  int cond;
+  int reg;
+  // the lines in order, without the removed ones
+  int prev;
+  int next;
+} Line;
+
+typedef struct {
+  char *name;
+  int len;
+  // the line defining it, or -1 once it is removed
+  int def;
+  // how many branches go to it
+  int refs;
+  bool pinned;
+} Label;
+
+typedef struct {
+  Line *lines;
+  int num_lines;
+  Label *labels;
+  int num_labels;
+  // open addressing hash table of label numbers, -1 when empty
+  int *buckets;
+  int num_buckets;
+  bool changed;
+} Cfg;
+
+// Conditions in pairs, each the inverse of the other. For cbz and cbnz,
+// the condition is COND_ZERO or COND_NONZERO.
+static char *conds[] = {
+  "eq", "ne", "lt", "ge", "le", "gt", "hi", "ls",
+  "lo", "hs", "mi", "pl", "vs", "vc", "cs", "cc",
+};
+
+#define NUM_CONDS 16
+#define COND_ZERO 16
+#define COND_NONZERO 17
+
+static int inverse(int cond) {
+  return cond ^ 1;
+}
+
+static bool is_ident_char(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static unsigned hash(char *p, int len) {
+  unsigned h = 2166136261;
+  for (int i = 0; i < len; i++) h = (h ^ (unsigned char)p[i]) * 16777619;
+  return h;
+}
+
+// Returns the number of the label named by the `len` bytes at `p`, adding
+// it if `add` is set, or -1 if there is no such label.
+static int find_label(Cfg *cfg, char *p, int len, bool add) {
+  unsigned i = hash(p, len) & (cfg->num_buckets - 1);
+  for (;; i = (i + 1) & (cfg->num_buckets - 1)) {
+    int n = cfg->buckets[i];
+    if (n < 0) break;
+    Label *l = &cfg->labels[n];
+    if (l->len == len && !strncmp(l->name, p, len)) return n;
+  }
+  if (!add) return -1;
+
+  int n = cfg->num_labels++;
+  cfg->labels[n] = (Label){p, len, -1, 0, len < 2 || strncmp(p, ".L", 2)};
+  cfg->buckets[i] = n;
+  return n;
+}
+
+// Keeps the labels named in `line` where they are.
+static void pin_labels(Cfg *cfg, char *p, char *end) {
+  while (p < end) {
+    if (!is_ident_char(*p)) {
+      p++;
+      continue;
+    }
+    char *start = p;
+    while (p < end && is_ident_char(*p)) p++;
+    int label = find_label(cfg, start, p - start, false);
+    if (label >= 0) cfg->labels[label].pinned = true;
+  }
+}
+
+// Returns the number of register x0 to x30 named by the `len` bytes at
+// `p`, or -1 if they do not name one.
+static int reg_number(char *p, int len) {
+  if (len < 2 || len > 3 || p[0] != 'x') return -1;
+  int n = 0;
+  for (int i = 1; i < len; i++) {
+    if (!isdigit(p[i])) return -1;
+    n = n * 10 + p[i] - '0';
+  }
+  return n <= 30 ? n : -1;
+}
+
+static int cond_number(char *p, int len) {
+  if (len == 3 && *p == '.') {
+    p++;
+    len--;
+  }
+  for (int i = 0; i < NUM_CONDS; i++)
+    if (len == 2 && !strncmp(p, conds[i], 2)) return i;
+  return -1;
+}
+
+static bool is_mnemonic(char *p, int len, char *name) {
+  return len == (int)strlen(name) && !strncmp(p, name, len);
+}
+
+// Classifies instruction `line`, given its mnemonic of `len` bytes at `p`
+// and its operands from `ops` to `end`.
+static void parse_insn(Cfg *cfg, Line *line, char *p, int len, char *ops,
+                       char *end) {
+  line->kind = LINE_INSN;
+  if (is_mnemonic(p, len, "ret") || is_mnemonic(p, len, "br")) {
+    line->kind = LINE_EXIT;
+    return;
+  }
+
+  bool jump = is_mnemonic(p, len, "b");
+  int cond = *p == 'b' ? cond_number(p + 1, len - 1) : -1;
+  int reg = -1;
+  if (is_mnemonic(p, len, "cbz") || is_mnemonic(p, len, "cbnz")) {
+    char *comma = memchr(ops, ',', end - ops);
+    reg = comma ? reg_number(ops, comma - ops) : -1;
+    if (reg >= 0) {
+      cond = len == 3 ? COND_ZERO : COND_NONZERO;
+      for (ops = comma + 1; ops < end && *ops == ' '; ops++)
+        ;
+    }
+  }
+  if (!jump && cond < 0) {
+    pin_labels(cfg, ops, end);
+    return;
+  }
+
+  int label = find_label(cfg, ops, end - ops, false);
+  if (label < 0) {
+    // a branch out of the function never comes back
+    if (jump) line->kind = LINE_EXIT;
+    return;
+  }
+  line->kind = jump ? LINE_JUMP : LINE_BRANCH;
+  line->label = label;
+  line->cond = cond;
+  line->reg = reg;
+}
+
+// Splits the code in `buf` into lines and finds the labels they define and
+// refer to.
+static void parse_code(Cfg *cfg, char *buf, size_t len) {
+  char *end = buf + len;
+  for (char *p = buf; p < end; cfg->num_lines++) {
+    char *next = memchr(p, '\n', end - p);
+    p = next ? next + 1 : end;
+  }
+
+  cfg->lines = calloc(cfg->num_lines, sizeof(Line));
+  cfg->labels = calloc(cfg->num_lines, sizeof(Label));
+  cfg->num_buckets = 16;
+  while (cfg->num_buckets < cfg->num_lines * 2) cfg->num_buckets *= 2;
+  cfg->buckets = malloc(cfg->num_buckets * sizeof(int));
+  if (!cfg->lines || !cfg->labels || !cfg->buckets) error("out of memory");
+  memset(cfg->buckets, -1, cfg->num_buckets * sizeof(int));
+
+  // labels first, so that branches can refer to later ones
+  char *p = buf;
+  for (int i = 0; i < cfg->num_lines; i++) {
+    char *next = memchr(p, '\n', end - p);
+    next = next ? next + 1 : end;
+    Line *line = &cfg->lines[i];
+    *line = (Line){LINE_DIRECTIVE, p, next - p, -1, -1, -1, i - 1, i + 1};
+
+    char *q = next;
+    while (q > p && isspace(q[-1])) q--;
+    if (!isspace(*p) && q > p && q[-1] == ':') {
+      line->kind = LINE_LABEL;
+      line->label = find_label(cfg, p, q - 1 - p, true);
+      cfg->labels[line->label].def = i;
+    }
+    p = next;
+  }
+  cfg->lines[cfg->num_lines - 1].next = -1;
+
+  for (int i = 0; i < cfg->num_lines; i++) {
+    Line *line = &cfg->lines[i];
+    if (line->kind == LINE_LABEL) continue;
+
+    char *p = line->text;
+    char *end = p + line->len;
+    while (end > p && isspace(end[-1])) end--;
+    while (p < end && *p == ' ') p++;
+    if (p == end || !isalpha(*p)) {
+      pin_labels(cfg, p, end);
+      continue;
+    }
+
+    char *ops = p;
+    while (ops < end && !isspace(*ops)) ops++;
+    int len = ops - p;
+    while (ops < end && isspace(*ops)) ops++;
+    parse_insn(cfg, line, p, len, ops, end);
+  }
+}
+
+static void remove_line(Cfg *cfg, int i) {
+  Line *line = &cfg->lines[i];
+  if (line->prev >= 0) cfg->lines[line->prev].next = line->next;
+  if (line->next >= 0) cfg->lines[line->next].prev = line->prev;
+  if (line->kind == LINE_LABEL) cfg->labels[line->label].def = -1;
+  cfg->changed = true;
+}
+
+// Returns the first line after line `i` which is not a label, or -1.
+static int skip_labels(Cfg *cfg, int i) {
+  i = cfg->lines[i].next;
+  while (i >= 0 && cfg->lines[i].kind == LINE_LABEL) i = cfg->lines[i].next;
+  return i;
+}
+
+// Returns the first instruction run from `label`, or -1.
+static int label_target(Cfg *cfg, int label) {
+  int def = cfg->labels[label].def;
+  return def < 0 ? -1 : skip_labels(cfg, def);
+}
+
+// Returns whether line `i` goes on to `label` by falling through.
+static bool falls_into(Cfg *cfg, int i, int label) {
+  for (i = cfg->lines[i].next; i >= 0 && cfg->lines[i].kind == LINE_LABEL;
+       i = cfg->lines[i].next)
+    if (cfg->lines[i].label == label) return true;
+  return false;
+}
+
+static bool can_fall_through(Line *line) {
+  return line->kind != LINE_JUMP && line->kind != LINE_EXIT;
+}
+
+static bool is_code(Line *line) {
+  return line->kind != LINE_LABEL && line->kind != LINE_DIRECTIVE;
+}
+
+// Returns whether line `i` is mov x<reg>, #<val>, setting `*val`.
+static bool is_mov_imm(Cfg *cfg, int i, int reg, long *val) {
+  Line *line = &cfg->lines[i];
+  if (line->kind != LINE_INSN) return false;
+  char name[8];
+  int n = snprintf(name, sizeof(name), "x%d", reg);
+  char *p = line->text;
+  while (*p == ' ') p++;
+  if (strncmp(p, "mov ", 4)) return false;
+  for (p += 4; *p == ' '; p++)
+    ;
+  if (strncmp(p, name, n) || strncmp(p + n, ", #", 3)) return false;
+  char *end;
+  *val = strtol(p + n + 3, &end, 10);
+  return end != p + n + 3 && *end == '\n';
+}
+
+// Returns the label the code continues at after line `i`, or -1 if there
+// is none right after it.
+static int label_after(Cfg *cfg, int i) {
+  int next = cfg->lines[i].next;
+  return next >= 0 && cfg->lines[next].kind == LINE_LABEL
+           ? cfg->lines[next].label
+           : -1;
+}
+
+// Returns where branch `i` may go instead of its label, or -1.
+static int thread(Cfg *cfg, int i) {
+  Line *line = &cfg->lines[i];
+  int target = label_target(cfg, line->label);
+  if (target < 0 || target == i) return -1;
+  Line *dest = &cfg->lines[target];
+
+  if (dest->kind == LINE_JUMP) return dest->label;
+  if (dest->kind != LINE_BRANCH) return -1;
+
+  // whether the branch at the label is taken when this one is
+  int taken;
+  long val;
+  if (line->kind == LINE_BRANCH && line->reg == dest->reg &&
+      (line->cond == dest->cond || line->cond == inverse(dest->cond)))
+    taken = line->cond == dest->cond;
+  else if (line->kind == LINE_JUMP && dest->reg >= 0 && line->prev >= 0 &&
+           is_mov_imm(cfg, line->prev, dest->reg, &val))
+    taken = (val == 0) == (dest->cond == COND_ZERO);
+  else
+    return -1;
+
+  return taken ? dest->label : label_after(cfg, target);
+}
+
+// Moves the block at the label of jump `i` in its place if nothing else
+// reaches it, and it does not fall through to the block after it. Returns
+// whether it did.
+static bool merge(Cfg *cfg, int i) {
+  Label *label = &cfg->labels[cfg->lines[i].label];
+  if (label->refs != 1 || label->pinned || label->def < 0) return false;
+  int prev = cfg->lines[label->def].prev;
+  if (prev < 0 || can_fall_through(&cfg->lines[prev])) return false;
+
+  int first = cfg->lines[label->def].next;
+  int last = first;
+  for (; last >= 0; last = cfg->lines[last].next) {
+    Line *line = &cfg->lines[last];
+    if (last == i || !is_code(line)) return false;
+    if (!can_fall_through(line)) break;
+  }
+  if (last < 0) return false;
+
+  // unlink the block with its label, and link it in after the jump
+  remove_line(cfg, label->def);
+  Line *f = &cfg->lines[first];
+  Line *l = &cfg->lines[last];
+  cfg->lines[f->prev].next = l->next;
+  if (l->next >= 0) cfg->lines[l->next].prev = f->prev;
+
+  Line *jump = &cfg->lines[i];
+  f->prev = i;
+  l->next = jump->next;
+  if (jump->next >= 0) cfg->lines[jump->next].prev = last;
+  jump->next = first;
+  remove_line(cfg, i);
+  return true;
+}
+
+static void count_refs(Cfg *cfg) {
+  for (int i = 0; i < cfg->num_labels; i++) cfg->labels[i].refs = 0;
+  for (int i = 0; i >= 0; i = cfg->lines[i].next) {
+    Line *line = &cfg->lines[i];
+    if (line->kind == LINE_JUMP || line->kind == LINE_BRANCH)
+      cfg->labels[line->label].refs++;
+  }
+}
+
+static void simplify(Cfg *cfg) {
+  for (int i = 0; i >= 0; i = cfg->lines[i].next) {
+    Line *line = &cfg->lines[i];
+    if (line->kind != LINE_JUMP && line->kind != LINE_BRANCH) continue;
+
+    int label = thread(cfg, i);
+    if (label >= 0 && label != line->label) {
+      line->label = label;
+      cfg->changed = true;
+    }
+
+    if (falls_into(cfg, i, line->label)) {
+      remove_line(cfg, i);
+      continue;
+    }
+
+    // b<cond> L1; b L2; L1: becomes b<!cond> L2; L1:
+    int next = line->next;
+    if (line->kind == LINE_BRANCH && next >= 0 &&
+        cfg->lines[next].kind == LINE_JUMP &&
+        falls_into(cfg, next, line->label)) {
+      line->cond = inverse(line->cond);
+      line->label = cfg->lines[next].label;
+      remove_line(cfg, next);
+      cfg->changed = true;
+    }
+  }
+
+  count_refs(cfg);
+  for (int i = 0; i >= 0; i = cfg->lines[i].next) {
+    Line *line = &cfg->lines[i];
+    if (line->kind == LINE_JUMP && merge(cfg, i)) count_refs(cfg);
+  }
+
+  for (int i = 0; i >= 0; i = cfg->lines[i].next) {
+    Line *line = &cfg->lines[i];
+    if (line->kind == LINE_LABEL) {
+      Label *label = &cfg->labels[line->label];
+      if (!label->refs && !label->pinned) remove_line(cfg, i);
+      continue;
+    }
+    if (can_fall_through(line)) continue;
+    while (line->next >= 0 && is_code(&cfg->lines[line->next]))
+      remove_line(cfg, line->next);
+  }
+}
+
+static void print_line(Cfg *cfg, Line *line, FILE *out) {
+  if (line->kind != LINE_JUMP && line->kind != LINE_BRANCH) {
+    fwrite(line->text, 1, line->len, out);
+    return;
+  }
+
+  Label *label = &cfg->labels[line->label];
+  if (line->kind == LINE_JUMP)
+    fprintf(out, "    b ");
+  else if (line->reg < 0)
+    fprintf(out, "    b%s ", conds[line->cond]);
+  else
+    fprintf(out, "    %s x%d, ", line->cond == COND_ZERO ? "cbz" : "cbnz",
+            line->reg);
+  fprintf(out, "%.*s\n", label->len, label->name);
+}
+
+// Simplifies the control flow of the generated code in `*buf`, replacing
+// it.
+void simplify_cfg(char **buf, size_t *len) {
+  if (!*len) return;
+  Cfg cfg = {0};
+  parse_code(&cfg, *buf, *len);
+
+  cfg.changed = true;
+  for (int round = 0; cfg.changed && round < MAX_ROUNDS; round++) {
+    cfg.changed = false;
+    simplify(&cfg);
+  }
+
+  char *new_buf;
+  size_t new_len;
+  FILE *out = open_memstream(&new_buf, &new_len);
+  for (int i = 0; i >= 0; i = cfg.lines[i].next)
+    print_line(&cfg, &cfg.lines[i], out);
+  fclose(out);
+
+  free(cfg.lines);
+  free(cfg.labels);
+  free(cfg.buckets);
+  free(*buf);
+  *buf = new_buf;
+  *len = new_len;
+}
@@ -1,38 +1,435 @@
 #include "quackcc.h"
 
-static int depth;
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
 static char *argreg[] = {"x0", "x1", "x2", "x3", "x4", "x5", "x6", "x7"};
-static Fun *current_function;
+
+// Code generation state. Functions are generated independently of each
+// other, possibly on different threads, so the state is thread-local and
+// reset by gen_func for every function.
+static _Thread_local FILE *out;
+static _Thread_local int depth;
+static _Thread_local int label_count;
+static _Thread_local Fun *current_function;
+// whether the current function takes the address of any local; pointer
+// arithmetic from it may reach every other one
+static _Thread_local bool addresses_taken;
+
+// operators of the binary chains being generated and the needs of their
+// operands, see gen_binary()
+static _Thread_local Node **chain_ops;
+static _Thread_local int *chain_needs;
+static _Thread_local int *chain_lhs_needs;
+static _Thread_local int chain_len;
+static _Thread_local int chain_cap;
+// temporaries holding operands, see need()
+static _Thread_local int temp_depth;
+
+// where a break statement jumps to
+static _Thread_local int break_label;
+
+// code moved out of line by -fprofile-use, see gen_cold_block()
+static _Thread_local FILE *cold_out;
+static _Thread_local char *cold_buf;
+static _Thread_local size_t cold_len;
+static _Thread_local bool in_cold;
+
+// -fvectorize-report remarks of the function being generated, or NULL
+static _Thread_local FILE *remarks_out;
+
+// branch sites counted by -finstrument, see gen_count_branch()
+static _Thread_local Node **sites;
+static _Thread_local int num_sites;
+static _Thread_local int sites_cap;
+
+// values kept in registers for reuse, see number_function()
+typedef struct {
+  Node *node;
+  // the value is in x<FIRST_CSE_REG + reg>
+  int reg;
+  // whether `node` puts its value there, rather than taking it from there
+  bool save;
+} CseMark;
+
+static _Thread_local CseMark *marks;
+static _Thread_local int marks_cap;
+static _Thread_local int num_marks;
+// set while generating code only to count its instructions
+static _Thread_local bool counting;
+// instructions saved in the current function, for -fmem-report
+static _Thread_local long eliminated;
 
 static void gen_expr(Node *node);
+static void gen_stmt(Node *node);
+static void gen_binary(Node *node);
+static void gen_branch(Node *node, bool jump_if, int label);
+static void gen_compare(Node *node);
+static void gen_update(Node *node, bool used);
+static bool visit(Node *node, bool (*fn)(Node *, void *), void *arg);
+static void annotate(Node *node);
 
-static char *gen_simple_label_name() {
-  static int i = 1;
-  char *label = malloc(16);
-  snprintf(label, 16, ".L%d.%s", i++, current_function->name);
-  return label;
+static void emit(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(out, fmt, ap);
+  va_end(ap);
+}
+
+// Labels are numbers, named .L<number>.<function> in the output, so that
+// the output for a function does not depend on which other functions were
+// generated before it. 0 is no label.
+#define RETURN_LABEL -1
+
+static int new_label(void) {
+  return ++label_count;
+}
+
+static void print_label(int label) {
+  if (label == RETURN_LABEL)
+    fprintf(out, ".L.return.%s", current_function->name);
+  else
+    fprintf(out, ".L%d.%s", label, current_function->name);
 }
 
-static char *gen_return_label_name() {
-  char *label = malloc(16);
-  snprintf(label, 16, ".L.return.%s", current_function->name);
+static void emit_label(int label) {
+  print_label(label);
+  emit(":\n");
+}
+
+// Emits instruction `insn` with `label` as its last operand.
+static void emit_jump(char *insn, int label) {
+  emit("    %s ", insn);
+  print_label(label);
+  emit("\n");
+}
+
+static char *gen_prof_label_name(char *what) {
+  char *name = current_function->name;
+  int len = snprintf(NULL, 0, ".L.prof.%s.%s", what, name) + 1;
+  char *label = allocate(len);
+  snprintf(label, len, ".L.prof.%s.%s", what, name);
   return label;
 }
 
+// -finstrument
+//
+// Every function counts how often it is called and, for every if, while
+// and for condition, how often it was true and how often false. The
+// counters of a function are laid out as
+//
+//   calls, (true, false) for each branch site in source order
+//
+// next to a record describing them, which a constructor registers with the
+// runtime in runtime/profile.c. The runtime writes all counts to a profile
+// at exit. Counting uses x9-x11, which codegen does not otherwise use.
+
+static void gen_counters_addr(void) {
+  char *counters = gen_prof_label_name("counters");
+  emit("    adrp x9, %s@PAGE\n", counters);
+  emit("    add x9, x9, %s@PAGEOFF\n", counters);
+}
+
+static void gen_count_call(void) {
+  gen_counters_addr();
+  emit("    ldr x10, [x9]\n");
+  emit("    add x10, x10, #1\n");
+  emit("    str x10, [x9]\n");
+}
+
+// Counts the outcome of the condition of `node`, which was just compared
+// against zero. Leaves the flags alone.
+static void gen_count_branch(Node *node) {
+  if (num_sites == sites_cap) {
+    sites_cap = sites_cap ? sites_cap * 2 : 16;
+    Node **new_sites = allocate(sites_cap * sizeof(Node *));
+    if (num_sites) memcpy(new_sites, sites, num_sites * sizeof(Node *));
+    sites = new_sites;
+  }
+  int offset = 8 + 16 * num_sites;
+  sites[num_sites++] = node;
+
+  gen_counters_addr();
+  if (offset > 504) {
+    emit("    mov x10, #%d\n", offset);
+    emit("    add x9, x9, x10\n");
+    offset = 0;
+  }
+  emit("    ldp x10, x11, [x9, #%d]\n", offset);
+  emit("    cinc x10, x10, ne\n");
+  emit("    cinc x11, x11, eq\n");
+  emit("    stp x10, x11, [x9, #%d]\n", offset);
+}
+
+static int site_kind(Node *node) {
+  switch (node->kind) {
+  case NK_IF_STMT:
+    return 0;
+  case NK_WHILE_STMT:
+    return 1;
+  default:
+    return 2;
+  }
+}
+
+// Emits the counters of the current function, the record describing them,
+// and a constructor registering the record. The layout of the record is
+// QccProfFunction in runtime/profile.c.
+static void gen_profile_data(Fun *fun) {
+  char *counters = gen_prof_label_name("counters");
+  char *site_table = gen_prof_label_name("sites");
+  char *name = gen_prof_label_name("name");
+  char *record = gen_prof_label_name("function");
+  char *init = gen_prof_label_name("init");
+
+  emit("    .data\n");
+  emit("    .p2align 3\n");
+  emit("%s:\n", counters);
+  emit("    .space %d\n", 8 + 16 * num_sites);
+  emit("%s:\n", site_table);
+  for (int i = 0; i < num_sites; i++)
+    emit("    .long %d, %d, %d\n", sites[i]->token->line,
+         sites[i]->token->col, site_kind(sites[i]));
+  emit("%s:\n", name);
+  emit("    .asciz \"%s\"\n", fun->name);
+  emit("    .p2align 3\n");
+  emit("%s:\n", record);
+  emit("    .quad 0\n");
+  emit("    .quad %s\n", name);
+  emit("    .quad %d\n", fun->token->line);
+  emit("    .quad %d\n", fun->token->col);
+  emit("    .quad %d\n", num_sites);
+  emit("    .quad %s\n", counters);
+  emit("    .quad %s\n", site_table);
+
+  emit("    .text\n");
+  emit("%s:\n", init);
+  emit("    stp fp, lr, [sp, #-16]!\n");
+  emit("    mov fp, sp\n");
+  emit("    adrp x0, %s@PAGE\n", record);
+  emit("    add x0, x0, %s@PAGEOFF\n", record);
+  emit("    bl _qcc_prof_register\n");
+  emit("    ldp fp, lr, [sp], #16\n");
+  emit("    ret\n");
+
+  emit("    .section __DATA,__mod_init_func,mod_init_funcs\n");
+  emit("    .p2align 3\n");
+  emit("    .quad %s\n", init);
+  emit("    .text\n\n");
+}
+
 static void push(char* reg) {
-    printf("    str %s, [sp, #-16]!\n", reg);
+    emit("    str %s, [sp, #-16]!\n", reg);
     depth++;
 }
 
 static void pop(char* reg) {
-    printf("    ldr %s, [sp], #16\n", reg);
+    emit("    ldr %s, [sp], #16\n", reg);
     depth--;
 }
 
+// Common subexpression elimination
+//
+// x[i][j] = x[i][j] + 1 computes the address of x[i][j] twice. Values
+// computed by the arithmetic operators from numbers, variables and array
+// addresses are numbered by number_function() so that equal values get the
+// same number, and an operator computing a value that an earlier one has
+// computed on every path to it takes it from a register instead. The first
+// one saves its value to one of the scratch registers x12 to x15. Calls
+// clobber these registers, so no value survives a call.
+
+#define FIRST_CSE_REG 12
+#define NUM_CSE_REGS 4
+
+static CseMark *find_mark(Node *node, bool insert) {
+  if (insert && num_marks * 2 >= marks_cap) {
+    CseMark *old = marks;
+    int old_cap = marks_cap;
+    marks_cap = marks_cap ? marks_cap * 2 : 64;
+    marks = allocate(marks_cap * sizeof(CseMark));
+    num_marks = 0;
+    for (int i = 0; i < old_cap; i++)
+      if (old[i].node) *find_mark(old[i].node, true) = old[i];
+  }
+  if (!marks_cap) return NULL;
+
+  int i = ((uintptr_t)node >> 4) * FNV_PRIME & (marks_cap - 1);
+  for (; marks[i].node; i = (i + 1) & (marks_cap - 1))
+    if (marks[i].node == node) return &marks[i];
+  if (!insert) return NULL;
+  marks[i].node = node;
+  num_marks++;
+  return &marks[i];
+}
+
+static CseMark *get_mark(Node *node) {
+  return num_marks && !counting ? find_mark(node, false) : NULL;
+}
+
+// Returns the number of instructions generating `node` takes.
+static long count_insns(Node *node) {
+  FILE *saved_out = out;
+  char *buf;
+  size_t len;
+  out = open_memstream(&buf, &len);
+  // without reuse, operands can need more
+  counting = true;
+  annotate(node);
+  gen_binary(node);
+  counting = false;
+  annotate(node);
+  fclose(out);
+  out = saved_out;
+
+  long n = 0;
+  for (size_t i = 0; i < len; i++) n += buf[i] == '\n';
+  free(buf);
+  return n;
+}
+
+static void gen_reuse(Node *node, CseMark *mark, char *reg) {
+  if (opt->mem_report) eliminated += count_insns(node) - 1;
+  emit("    mov %s, x%d\n", reg, FIRST_CSE_REG + mark->reg);
+}
+
+static void gen_save(CseMark *mark) {
+  if (opt->mem_report) eliminated--;
+  emit("    mov x%d, x0\n", FIRST_CSE_REG + mark->reg);
+}
+
+// whether `offset` fits ldr and str, either scaled or unscaled
+static bool fits_offset(long offset) {
+  return (offset >= -256 && offset < 256) ||
+         (offset >= 0 && offset <= 32760 && offset % 8 == 0);
+}
+
+// Loads variable `var` into `reg`.
+static void gen_load_var(char *reg, Obj *var) {
+  if (var->reg) {
+    emit("    mov %s, x%d\n", reg, var->reg);
+  } else if (fits_offset(var->offset)) {
+    emit("    ldr %s, [fp, #%d]\n", reg, var->offset);
+  } else {
+    emit("    add %s, fp, #%d\n", reg, var->offset);
+    emit("    ldr %s, [%s]\n", reg, reg);
+  }
+}
+
+// Stores `reg` into variable `var`.
+static void gen_store_var(char *reg, Obj *var) {
+  if (var->reg) {
+    emit("    mov x%d, %s\n", var->reg, reg);
+  } else if (fits_offset(var->offset)) {
+    emit("    str %s, [fp, #%d]\n", reg, var->offset);
+  } else {
+    emit("    add x16, fp, #%d\n", var->offset);
+    emit("    str %s, [x16]\n", reg);
+  }
+}
+
+// Addressing modes
+//
+// Pointer arithmetic p + i and p - i scales i by the size of what p points
+// to, so loads and stores of *(p + i) compute p + i * 8 into x0 first. When
+// the scale is 8, the scaled index is folded into the load or store as
+// [p, i, lsl #3], and when i is a number, the whole offset is folded in as
+// [p, #offset]. A base that is a local array or a variable in a register is
+// addressed directly, relative to fp or that register.
+
+typedef struct {
+  Node *base;
+  // index scaled by 8, or NULL
+  Node *index;
+  long offset;
+} Address;
+
+// Returns whether `node` is pointer arithmetic, p + i * size or p - i * size.
+static bool is_scaled(Node *node) {
+  return (node->kind == NK_ADD || node->kind == NK_SUB) &&
+         !is_integer(node->lhs->type) && node->rhs->kind == NK_MUL &&
+         node->rhs->rhs->kind == NK_NUM;
+}
+
+// Returns whether the address `node` can be folded into a load or store,
+// and if so, describes it in `addr`. An address whose value is reused is
+// left alone; scaled indexes never are, see number_binary().
+static bool fold_address(Node *node, Address *addr) {
+  if (!is_scaled(node) || get_mark(node)) return false;
+  Node *scale = node->rhs;
+  addr->base = node->lhs;
+
+  if (scale->lhs->kind == NK_NUM) {
+    addr->index = NULL;
+    addr->offset = (long)scale->lhs->val * scale->rhs->val;
+    if (node->kind == NK_SUB) addr->offset = -addr->offset;
+    return fits_offset(addr->offset);
+  }
+
+  addr->index = scale->lhs;
+  addr->offset = 0;
+  return node->kind == NK_ADD && scale->rhs->val == 8;
+}
+
+// Generates the registers `addr` needs, and returns the operand of the load
+// or store.
+static char *gen_address(Address *addr) {
+  static _Thread_local char operand[64];
+  Node *base = addr->base;
+  Obj *var = base->kind == NK_VAR ? base->var : NULL;
+
+  if (!addr->index) {
+    if (var && var->type->kind == TYK_ARRAY &&
+        fits_offset(var->offset + addr->offset)) {
+      snprintf(operand, sizeof(operand), "[fp, #%ld]",
+               var->offset + addr->offset);
+    } else if (var && var->reg) {
+      snprintf(operand, sizeof(operand), "[x%d, #%ld]", var->reg,
+               addr->offset);
+    } else {
+      gen_expr(base);
+      snprintf(operand, sizeof(operand), "[x0, #%ld]", addr->offset);
+    }
+    return operand;
+  }
+
+  if (var && var->reg) {
+    gen_expr(addr->index);
+    snprintf(operand, sizeof(operand), "[x%d, x0, lsl #3]", var->reg);
+    return operand;
+  }
+
+  gen_expr(base);
+  push("x0");
+  gen_expr(addr->index);
+  emit("    mov x1, x0\n");
+  pop("x0");
+  return "[x0, x1, lsl #3]";
+}
+
+// Generates the assignment `node`, whose value is not used, if it stores
+// to an address that can be folded. Returns whether it did. The value of
+// an assignment is the address stored to (see store()), which is not
+// computed then.
+static bool gen_folded_store(Node *node) {
+  Address addr;
+  if (node->kind != NK_ASSIGN || node->lhs->kind != NK_DEREF ||
+      !fold_address(node->lhs->lhs, &addr))
+    return false;
+
+  gen_expr(node->rhs);
+  push("x0");
+  char *operand = gen_address(&addr);
+  pop("x2");
+  emit("    str x2, %s\n", operand);
+  return true;
+}
+
 static void gen_addr(Node *node) {
   switch (node->kind) {
   case NK_VAR:
-    printf("    add x0, fp, #%d\n", node->var->offset);
+    emit("    add x0, fp, #%d\n", node->var->offset);
     return;
   case NK_DEREF:
     gen_expr(node->lhs);
@@ -49,44 +446,192 @@ static void load(Type *type) {
     return;
   }
 
-  printf("    ldr x0, [x0]\n");
+  emit("    ldr x0, [x0]\n");
 }
 
 static void store(void) {
   // this is assuming that x1 is unused; we'll also store into x0
   pop("x1");
-  printf("    str x1, [x0]\n");
+  emit("    str x1, [x0]\n");
+}
+
+static bool is_var(Node *node, Obj *var) {
+  return node->kind == NK_VAR && node->var == var;
+}
+
+static bool is_num(Node *node, int val) {
+  return node->kind == NK_NUM && node->val == val;
+}
+
+// Returns whether `node` is a compound assignment or an increment.
+static bool is_update(Node *node) {
+  switch (node->kind) {
+  case NK_ADD_ASSIGN:
+  case NK_SUB_ASSIGN:
+  case NK_MUL_ASSIGN:
+  case NK_DIV_ASSIGN:
+  case NK_POST_INC:
+  case NK_POST_DEC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Returns whether `node` assigns to its lhs.
+static bool is_assignment(Node *node) {
+  return node->kind == NK_ASSIGN || is_update(node);
+}
+
+// Returns whether `node` adds a number to variable `var`, as i = i + 1,
+// i += 1 and i++ do, and if so, sets `*step` to the number.
+static bool is_step(Node *node, Obj *var, int *step) {
+  if (!is_assignment(node) || !is_var(node->lhs, var)) return false;
+  Node *rhs = node->rhs;
+
+  switch (node->kind) {
+  case NK_ASSIGN:
+    if ((rhs->kind != NK_ADD && rhs->kind != NK_SUB) ||
+        !is_var(rhs->lhs, var) || rhs->rhs->kind != NK_NUM)
+      return false;
+    *step = rhs->kind == NK_ADD ? rhs->rhs->val : -rhs->rhs->val;
+    return true;
+  case NK_ADD_ASSIGN:
+  case NK_POST_INC:
+    if (rhs->kind != NK_NUM) return false;
+    *step = rhs->val;
+    return true;
+  case NK_SUB_ASSIGN:
+  case NK_POST_DEC:
+    if (rhs->kind != NK_NUM) return false;
+    *step = -rhs->val;
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_binary(Node *node) {
+  switch (node->kind) {
+  case NK_ADD:
+  case NK_SUB:
+  case NK_MUL:
+  case NK_DIV:
+  case NK_EQ:
+  case NK_NE:
+  case NK_LT:
+  case NK_LE:
+  case NK_GT:
+  case NK_GE:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_comparison(Node *node) {
+  switch (node->kind) {
+  case NK_EQ:
+  case NK_NE:
+  case NK_LT:
+  case NK_LE:
+  case NK_GT:
+  case NK_GE:
+    return true;
+  default:
+    return false;
+  }
 }
 
+// the condition codes of the comparisons, and of their negations
+static char *cond_code[] = {
+  [NK_EQ] = "eq", [NK_NE] = "ne", [NK_LT] = "lt",
+  [NK_LE] = "le", [NK_GT] = "gt", [NK_GE] = "ge",
+};
+static char *inverse_code[] = {
+  [NK_EQ] = "ne", [NK_NE] = "eq", [NK_LT] = "ge",
+  [NK_LE] = "gt", [NK_GT] = "le", [NK_GE] = "lt",
+};
+
 static void gen_expr(Node *node) {
+  CseMark *mark = get_mark(node);
+  if (mark && !mark->save) {
+    gen_reuse(node, mark, "x0");
+    return;
+  }
+
   switch(node->kind) {
   case NK_SIZEOF:
-    printf("    mov x0, #%d\n", node->lhs->type->size);
+    emit("    mov x0, #%d\n", node->lhs->type->size);
     return;
   case NK_NUM:
-    printf("    mov x0, #%d\n", node->val);
+    emit("    mov x0, #%d\n", node->val);
     return;
   case NK_NEG:
     gen_expr(node->lhs);
-    printf("    neg x0, x0\n");
+    emit("    neg x0, x0\n");
     return;
   case NK_VAR:
+    if (node->var->reg) {
+      gen_load_var("x0", node->var);
+      return;
+    }
     gen_addr(node);
     load(node->type);
     return;
   case NK_ASSIGN:
     gen_expr(node->rhs);
+    if (node->lhs->kind == NK_VAR && node->lhs->var->reg) {
+      gen_store_var("x0", node->lhs->var);
+      return;
+    }
     push("x0");
     gen_addr(node->lhs);
     store();
     return;
-  case NK_DEREF:
+  case NK_ADD_ASSIGN:
+  case NK_SUB_ASSIGN:
+  case NK_MUL_ASSIGN:
+  case NK_DIV_ASSIGN:
+  case NK_POST_INC:
+  case NK_POST_DEC:
+    gen_update(node, true);
+    return;
+  case NK_DEREF: {
+    Address addr;
+    if (node->type->kind != TYK_ARRAY && fold_address(node->lhs, &addr)) {
+      emit("    ldr x0, %s\n", gen_address(&addr));
+      return;
+    }
     gen_expr(node->lhs);
     load(node->type);
     return;
+  }
   case NK_ADDR:
     gen_addr(node->lhs);
     return;
+  case NK_NOT:
+    if (is_comparison(node->lhs) && !get_mark(node->lhs)) {
+      gen_compare(node->lhs);
+      emit("    cset x0, %s\n", inverse_code[node->lhs->kind]);
+      return;
+    }
+    gen_expr(node->lhs);
+    emit("    cmp x0, #0\n");
+    emit("    cset x0, eq\n");
+    return;
+  case NK_LOGAND:
+  case NK_LOGOR: {
+    int false_label = new_label();
+    int end = new_label();
+    gen_branch(node, false, false_label);
+    emit("    mov x0, #1\n");
+    emit_jump("b", end);
+    emit_label(false_label);
+    emit("    mov x0, #0\n");
+    emit_label(end);
+    return;
+  }
   case NK_FUNC_CALL: {
     int i = -1;
     // push onto stack, so that we can free up x0 for gen_expr
@@ -100,182 +645,2211 @@ static void gen_expr(Node *node) {
       pop(argreg[i]);
     }
     // call func
-    printf("    bl _%s\n", node->func_name);
+    emit("    bl _%s\n", node->func_name);
     return;
   }
   default:
     break;
   }
 
-  // evaluate rhs, then push the value in x0 on stack
-  // later on, we pop this value from the stack into x1 (since x0 is used by lhs)
-  gen_expr(node->rhs);
-  push("x0");
-  gen_expr(node->lhs);
-  pop("x1");
+  gen_binary(node);
+}
 
+// Applies the binary operator of `node` to registers `a` (lhs) and `b`
+// (rhs), leaving the result in x0.
+static void gen_binary_op(Node *node, char *a, char *b) {
   switch (node->kind) {
   case NK_ADD:
-    printf("    add x0, x0, x1\n");
+    emit("    add x0, %s, %s\n", a, b);
     return;
   case NK_SUB:
-    printf("    sub x0, x0, x1\n");
+    emit("    sub x0, %s, %s\n", a, b);
     return;
   case NK_MUL:
-    printf("    mul x0, x0, x1\n");
+    emit("    mul x0, %s, %s\n", a, b);
     return;
   case NK_DIV:
-    printf("    sdiv x0, x0, x1\n");
-    return;
-  case NK_EQ:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, eq\n");
-    return;
-  case NK_NE:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, ne\n");
-    return;
-  case NK_LT:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, lt\n");
+    emit("    sdiv x0, %s, %s\n", a, b);
     return;
-  case NK_LE:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, le\n");
+  default:
+    break;
+  }
+
+  if (!is_comparison(node)) error_at(node->token->loc, "invalid expression");
+  emit("    cmp %s, %s\n", a, b);
+  emit("    cset x0, %s\n", cond_code[node->kind]);
+}
+
+// Left associative operators nest to the left, so a long expression like
+// a+b+c+... is a deep chain of lhs links. The chain is collected first and
+// generated bottom-up, so that the recursion depth does not grow with its
+// length. The operators are kept on a stack shared with the chains nested
+// in the operands, along with the needs of their operands, see below.
+static void push_chain(Node *node) {
+  if (chain_len == chain_cap) {
+    chain_cap = chain_cap ? chain_cap * 2 : 64;
+    Node **ops = allocate(chain_cap * sizeof(Node *));
+    int *needs = allocate(chain_cap * sizeof(int));
+    int *lhs_needs = allocate(chain_cap * sizeof(int));
+    if (chain_len) {
+      memcpy(ops, chain_ops, chain_len * sizeof(Node *));
+      memcpy(needs, chain_needs, chain_len * sizeof(int));
+      memcpy(lhs_needs, chain_lhs_needs, chain_len * sizeof(int));
+    }
+    chain_ops = ops;
+    chain_needs = needs;
+    chain_lhs_needs = lhs_needs;
+  }
+  chain_ops[chain_len++] = node;
+}
+
+// Sethi-Ullman ordering
+//
+// While the rhs of an operator is evaluated, the value of the lhs is held
+// in one of the temporaries x3 to x8, or pushed on the stack once they run
+// out. The need of an expression is the number of temporaries evaluating it
+// takes. Numbers, variables and reused values are leaves, loaded straight
+// into the register the operator reads, and need -1. An operator with a
+// leaf operand needs what its other operand needs, and at least none, and
+// otherwise the larger need of its operands, or one more if they are equal,
+// as the side evaluated first is held while the other is evaluated. The
+// side that needs more goes first; C leaves the order of operands
+// unspecified. Calls clobber the temporaries, so an expression containing
+// one needs more than there are, and operands are held on the stack around
+// it. Operands are not reordered around reused values, which must be
+// computed in the order numbered, see number_function().
+
+#define NUM_TEMPS 6
+#define CALL_NEED (1 << 20)
+
+static char *temp_regs[] = {"x3", "x4", "x5", "x6", "x7", "x8"};
+
+static bool is_leaf(Node *node) {
+  if (node->kind == NK_NUM || node->kind == NK_SIZEOF || node->kind == NK_VAR)
+    return true;
+  CseMark *mark = get_mark(node);
+  return mark && !mark->save;
+}
+
+// Loads leaf `node` into `reg`.
+static void gen_leaf(Node *node, char *reg) {
+  CseMark *mark = get_mark(node);
+  if (mark) {
+    gen_reuse(node, mark, reg);
     return;
-  case NK_GT:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, gt\n");
+  }
+
+  switch (node->kind) {
+  case NK_NUM:
+    emit("    mov %s, #%d\n", reg, node->val);
     return;
-  case NK_GE:
-    printf("    cmp x0, x1\n");
-    printf("    mov x0, #0\n");
-    printf("    cset x0, ge\n");
+  case NK_SIZEOF:
+    emit("    mov %s, #%d\n", reg, node->lhs->type->size);
     return;
   default:
-    error_at(node->token->loc, "invalid expression");
+    if (node->var->type->kind == TYK_ARRAY)
+      emit("    add %s, fp, #%d\n", reg, node->var->offset);
+    else
+      gen_load_var(reg, node->var);
   }
 }
 
-static void gen_stmt(Node *node) {
+static int combine_needs(int lhs, int rhs) {
+  if (lhs >= CALL_NEED || rhs >= CALL_NEED) return CALL_NEED;
+  if (lhs < 0 || rhs < 0) return MAX(MAX(lhs, rhs), 0);
+  return lhs == rhs ? lhs + 1 : MAX(lhs, rhs);
+}
+
+// Returns the number of temporaries evaluating `node` takes, from the
+// needs of its operands.
+static int need(Node *node) {
+  if (is_leaf(node)) return -1;
+
   switch (node->kind) {
-    case NK_EXPR_STMT:
-      gen_expr(node->lhs);
-      return;
-    case NK_RETURN_STMT:
-      gen_expr(node->lhs);
-      printf("    b %s\n", gen_return_label_name());
-      return;
+  case NK_FUNC_CALL:
+    return CALL_NEED;
+  case NK_NEG:
+  case NK_NOT:
+  case NK_DEREF:
+    return MAX(node->lhs->need, 0);
+  case NK_LOGAND:
+  case NK_LOGOR:
+    // the operands are evaluated one after the other
+    return MAX(MAX(node->lhs->need, node->rhs->need), 0);
+  case NK_ADDR:
+    return node->lhs->kind == NK_DEREF ? MAX(node->lhs->lhs->need, 0) : 0;
+  case NK_ASSIGN:
+  case NK_ADD_ASSIGN:
+  case NK_SUB_ASSIGN:
+  case NK_MUL_ASSIGN:
+  case NK_DIV_ASSIGN:
+  case NK_POST_INC:
+  case NK_POST_DEC: {
+    int n = MAX(node->rhs->need, 0);
+    return node->lhs->kind == NK_DEREF ? MAX(n, node->lhs->lhs->need) : n;
+  }
+  default:
+    // statements have no value to hold
+    return is_binary(node) ? combine_needs(node->lhs->need, node->rhs->need)
+                           : 0;
+  }
+}
+
+// Sets the need and has_marks of `node` and every node within it, operands
+// first, in one pass over the function before it is generated; working them
+// out at each operator would go over its operands again. A chain of lhs
+// operands is walked without recursing, as in visit().
+static void annotate(Node *node) {
+  int base = chain_len;
+  for (Node *n = node; n; n = n->lhs) {
+    push_chain(n);
+    if (n->kind == NK_NUM || n->kind == NK_VAR || n->kind == NK_FUNC_CALL ||
+        n->kind == NK_COMPOUND_STMT || n->kind == NK_NULL_STMT ||
+        n->kind == NK_BREAK_STMT)
+      break;
+  }
+
+  while (chain_len > base) {
+    Node *n = chain_ops[--chain_len];
+    bool marked = get_mark(n) != NULL;
+
+    switch (n->kind) {
+    case NK_NUM:
+    case NK_VAR:
+    case NK_NULL_STMT:
+    case NK_BREAK_STMT:
+      break;
+    case NK_FUNC_CALL:
+      for (Node *arg = n->args; arg; arg = arg->next) {
+        annotate(arg);
+        marked |= arg->has_marks;
+      }
+      break;
     case NK_COMPOUND_STMT:
-      for (Node *stmt = node->body; stmt; stmt = stmt->next) {
-        gen_stmt(stmt);
-        assert(depth == 0);
+      for (Node *stmt = n->body; stmt; stmt = stmt->next) {
+        annotate(stmt);
+        marked |= stmt->has_marks;
       }
-      return;
-    case NK_NULL_STMT:
-      // do nothing
-      return;
-    case NK_IF_STMT: {
-      if (node->rhs == NULL) {
-        char *l = gen_simple_label_name();
-        gen_expr(node->cond);
-        printf("    cmp x0, #0\n");
-        printf("    beq %s\n", l);
-        gen_stmt(node->lhs);
-        printf("%s:\n", l);
-        return;
+      break;
+    case NK_WHILE_STMT:
+    case NK_FOR_STMT:
+    case NK_SWITCH_STMT:
+      if (n->body) {
+        annotate(n->body);
+        marked |= n->body->has_marks;
       }
-
-      char *l1 = gen_simple_label_name();
-      char *l2 = gen_simple_label_name();
-      gen_expr(node->cond);
-      printf("    cmp x0, #0\n");
-      printf("    beq %s\n", l1);
-      gen_stmt(node->lhs);
-      printf("    b %s\n", l2);
-      printf("%s:\n", l1);
-      gen_stmt(node->rhs);
-      printf("%s:\n", l2);
-      return;
-    }
-    case NK_WHILE_STMT: {
-      char *l1 = gen_simple_label_name();
-      char *l2 = gen_simple_label_name();
-      printf("%s:\n", l1);
-      gen_expr(node->cond);
-      printf("    cmp x0, #0\n");
-      printf("    beq %s\n", l2);
-      gen_stmt(node->body);
-      printf("    b %s\n", l1);
-      printf("%s:\n", l2);
-      return;
-    }
-    case NK_FOR_STMT: {
-      char *l1 = gen_simple_label_name();
-      char *l2 = gen_simple_label_name();
-      if (node->lhs != NULL) gen_expr(node->lhs);
-      printf("%s:\n", l1);
-      if (node->cond != NULL) {
-        gen_expr(node->cond);
-        printf("    cmp x0, #0\n");
-        printf("    beq %s\n", l2);
+      // fallthrough
+    case NK_IF_STMT:
+      if (n->cond) {
+        annotate(n->cond);
+        marked |= n->cond->has_marks;
       }
-      gen_stmt(node->body);
-      if (node->rhs != NULL) gen_expr(node->rhs);
-      printf("    b %s\n", l1);
-      printf("%s:\n", l2);
-      return;
-    }
+      // fallthrough
     default:
-      error_at(node->token->loc, "invalid statement");
+      if (n->rhs) {
+        annotate(n->rhs);
+        marked |= n->rhs->has_marks;
+      }
+      if (n->lhs) marked |= n->lhs->has_marks;
+    }
+
+    n->has_marks = marked;
+    n->need = need(n);
   }
 }
 
-static int align_to(int n, int align) {
-  return (n + align - 1) / align * align;
+// Generates the rhs of operator `n` with its lhs in x0, and applies `n`.
+static void gen_level(Node *n, int rhs_need) {
+  if (is_leaf(n->rhs)) {
+    gen_leaf(n->rhs, "x1");
+    gen_binary_op(n, "x0", "x1");
+  } else if (rhs_need + 1 <= NUM_TEMPS - temp_depth) {
+    char *temp = temp_regs[temp_depth++];
+    emit("    mov %s, x0\n", temp);
+    gen_expr(n->rhs);
+    temp_depth--;
+    gen_binary_op(n, temp, "x0");
+  } else {
+    push("x0");
+    gen_expr(n->rhs);
+    emit("    mov x1, x0\n");
+    pop("x0");
+    gen_binary_op(n, "x0", "x1");
+  }
+
+  CseMark *mark = get_mark(n);
+  if (mark && mark->save) gen_save(mark);
 }
 
-static void assign_lvar_offsets(Fun *fun) {
-  int offset = 0;
-  for (Obj *var = fun->locals; var; var = var->next) {
-    offset += var->type->size;
-    var->offset = -offset;
+// Generates the operators of a chain from chain_ops[bottom] up to
+// (excluding) chain_ops[end], leaving the result in x0.
+static void gen_levels(int bottom, int end) {
+  // evaluate the rhs of the highest operator worth it first
+  for (int i = end + 1; i < bottom; i++) {
+    Node *n = chain_ops[i];
+    int lhs_need = chain_lhs_needs[i];
+    int free = NUM_TEMPS - temp_depth;
+    if (chain_needs[i] <= lhs_need || chain_needs[i] > free ||
+        lhs_need + 1 > free || n->rhs->has_marks || n->lhs->has_marks)
+      continue;
+
+    gen_expr(n->rhs);
+    char *temp = temp_regs[temp_depth++];
+    emit("    mov %s, x0\n", temp);
+    gen_levels(bottom, i);
+    temp_depth--;
+    gen_binary_op(n, "x0", temp);
+    CseMark *mark = get_mark(n);
+    if (mark && mark->save) gen_save(mark);
+
+    for (int j = i - 1; j > end; j--) gen_level(chain_ops[j], chain_needs[j]);
+    return;
   }
-  fun->stack_size = align_to(offset, 16);
+
+  // the bottom operator, with its lhs loaded last if it is a leaf
+  Node *n = chain_ops[bottom];
+  if (bottom > end && is_leaf(n->lhs) && !is_leaf(n->rhs) &&
+      !n->rhs->has_marks && !get_mark(n->lhs)) {
+    gen_expr(n->rhs);
+    gen_leaf(n->lhs, "x1");
+    gen_binary_op(n, "x1", "x0");
+    CseMark *mark = get_mark(n);
+    if (mark && mark->save) gen_save(mark);
+  } else {
+    if (is_leaf(n->lhs)) gen_leaf(n->lhs, "x0");
+    else gen_expr(n->lhs);
+    if (bottom > end) gen_level(n, chain_needs[bottom]);
+  }
+
+  for (int j = bottom - 1; j > end; j--) gen_level(chain_ops[j], chain_needs[j]);
 }
 
-static void gen_func(Fun *fun) {
-  assign_lvar_offsets(fun);
+static void gen_binary(Node *node) {
+  int base = chain_len;
+  for (Node *n = node; is_binary(n); n = n->lhs) {
+    // an operand taken from a register ends the chain
+    CseMark *mark = n == node ? NULL : get_mark(n);
+    if (mark && !mark->save) break;
+    push_chain(n);
+  }
+  int bottom = chain_len - 1;
 
-  current_function = fun;
+  int lhs_need = chain_ops[bottom]->lhs->need;
+  for (int i = bottom; i >= base; i--) {
+    chain_needs[i] = chain_ops[i]->rhs->need;
+    chain_lhs_needs[i] = lhs_need;
+    lhs_need = combine_needs(lhs_need, chain_needs[i]);
+  }
 
-  printf(".global _%s\n\n", fun->name);
-  printf("_%s:\n", fun->name);
+  gen_levels(bottom, base - 1);
+  chain_len = base;
+}
 
-  // prologue
-  printf("    stp fp, lr, [sp, #-16]!\n");
-  printf("    mov fp, sp\n");
-  printf("    sub sp, sp, #%d\n", fun->stack_size);
+// Compound assignment
+//
+// x += y, x++ and the like compute the address of x once, and load, update
+// and store the value at it, with the address in x0 (or folded into the
+// load and store), the old value in x1 and the new one in x2. A number or
+// variable on the right is loaded after the address, and anything else is
+// evaluated before it. A variable in a register is updated in place.
 
-  // move params in registers into their allocated space in the stack
-  int i = 0;
-  for (Obj *var = fun->params; var; var = var->next)
-    printf("    str %s, [fp, %d] \n", argreg[i++], var->offset);
+static char *update_insn[] = {
+  [NK_ADD_ASSIGN] = "add", [NK_SUB_ASSIGN] = "sub",
+  [NK_MUL_ASSIGN] = "mul", [NK_DIV_ASSIGN] = "sdiv",
+  [NK_POST_INC] = "add", [NK_POST_DEC] = "sub",
+};
 
-  gen_stmt(fun->body);
+// Generates the address of lvalue `node` into at most x0, and returns the
+// operand of the load and store.
+static char *gen_lvalue(Node *node) {
+  static _Thread_local char operand[64];
 
-  // epilogue
-  printf("%s:\n", gen_return_label_name());
-  printf("    mov sp, fp\n");
-  printf("    ldp fp, lr, [sp], #16\n");
-  printf("    ret\n\n");
-}
+  if (node->kind == NK_VAR) {
+    if (fits_offset(node->var->offset)) {
+      snprintf(operand, sizeof(operand), "[fp, #%d]", node->var->offset);
+      return operand;
+    }
+    gen_addr(node);
+    return "[x0]";
+  }
 
-void codegen(Fun *prog) {
-  for (Fun *fun = prog; fun; fun = fun->next) gen_func(fun);
+  Address addr;
+  if (node->kind == NK_DEREF && fold_address(node->lhs, &addr)) {
+    char *folded = gen_address(&addr);
+    // x1 is needed for the old value
+    if (strcmp(folded, "[x0, x1, lsl #3]") == 0) {
+      emit("    add x0, x0, x1, lsl #3\n");
+      return "[x0]";
+    }
+    return folded;
+  }
+
+  gen_addr(node);
+  return "[x0]";
+}
+
+// Returns the second operand of the instruction updating with `node`: an
+// immediate if it is a number that fits one, and otherwise `reg`, which
+// the caller loads it into.
+static char *update_operand(Node *node, char *reg) {
+  bool add = node->kind == NK_ADD_ASSIGN || node->kind == NK_SUB_ASSIGN ||
+             node->kind == NK_POST_INC || node->kind == NK_POST_DEC;
+  Node *rhs = node->rhs;
+  if (!add || rhs->kind != NK_NUM || rhs->val < 0 || rhs->val > 4095)
+    return reg;
+  char *imm = allocate(8);
+  snprintf(imm, 8, "#%d", rhs->val);
+  return imm;
+}
+
+// Generates compound assignment or increment `node`, leaving its value in
+// x0 if `used`.
+static void gen_update(Node *node, bool used) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+  char *insn = update_insn[node->kind];
+  bool post = node->kind == NK_POST_INC || node->kind == NK_POST_DEC;
+  bool leaf = rhs->kind == NK_NUM || rhs->kind == NK_VAR;
+
+  if (lhs->kind == NK_VAR && lhs->var->reg) {
+    int reg = lhs->var->reg;
+    char *b = update_operand(node, "x1");
+    if (leaf && b[0] != '#') {
+      gen_leaf(rhs, "x1");
+    } else if (!leaf) {
+      gen_expr(rhs);
+      // x0 is needed for the old value
+      if (used && post) emit("    mov x1, x0\n");
+      else b = "x0";
+    }
+    if (used && post) emit("    mov x0, x%d\n", reg);
+    emit("    %s x%d, x%d, %s\n", insn, reg, reg, b);
+    if (used && !post) emit("    mov x0, x%d\n", reg);
+    return;
+  }
+
+  // the rhs is held on the stack while the address is computed
+  if (!leaf) {
+    gen_expr(rhs);
+    if (lhs->kind == NK_VAR) emit("    mov x2, x0\n");
+    else push("x0");
+  }
+  char *operand = gen_lvalue(lhs);
+  char *b = update_operand(node, "x2");
+  if (leaf && b[0] != '#') gen_leaf(rhs, "x2");
+  else if (!leaf && lhs->kind != NK_VAR) pop("x2");
+
+  emit("    ldr x1, %s\n", operand);
+  emit("    %s x2, x1, %s\n", insn, b);
+  emit("    str x2, %s\n", operand);
+  if (used) emit("    mov x0, %s\n", post ? "x1" : "x2");
+}
+
+// Generates expression `node` for its effects only.
+static void gen_void_expr(Node *node) {
+  if (gen_folded_store(node)) return;
+  if (is_update(node)) gen_update(node, false);
+  else gen_expr(node);
+}
+
+// Branches
+//
+// Conditions are generated as branches on the flags of their comparisons,
+// and && and || as chains of them, so that no 0 or 1 is materialised
+// unless an operand is not a comparison, which is then tested with cbz or
+// cbnz.
+
+// Compares the operands of comparison `node`, setting the flags, like
+// gen_levels() evaluates them.
+static void gen_compare(Node *node) {
+  Node *lhs = node->lhs;
+  Node *rhs = node->rhs;
+
+  if (rhs->kind == NK_NUM && rhs->val >= 0 && rhs->val < 4096) {
+    gen_expr(lhs);
+    emit("    cmp x0, #%d\n", rhs->val);
+  } else if (is_leaf(rhs)) {
+    gen_expr(lhs);
+    gen_leaf(rhs, "x1");
+    emit("    cmp x0, x1\n");
+  } else if (is_leaf(lhs) && !get_mark(lhs) && !rhs->has_marks) {
+    gen_expr(rhs);
+    gen_leaf(lhs, "x1");
+    emit("    cmp x1, x0\n");
+  } else if (rhs->need + 1 <= NUM_TEMPS - temp_depth) {
+    gen_expr(lhs);
+    char *temp = temp_regs[temp_depth++];
+    emit("    mov %s, x0\n", temp);
+    gen_expr(rhs);
+    temp_depth--;
+    emit("    cmp %s, x0\n", temp);
+  } else {
+    gen_expr(lhs);
+    push("x0");
+    gen_expr(rhs);
+    pop("x1");
+    emit("    cmp x1, x0\n");
+  }
+}
+
+// Jumps to `label` if condition `node` is true when `jump_if` is, or false
+// when it is not, and falls through otherwise.
+static void gen_branch(Node *node, bool jump_if, int label) {
+  switch (node->kind) {
+  case NK_NUM:
+    if ((node->val != 0) == jump_if) emit_jump("b", label);
+    return;
+  case NK_NOT:
+    gen_branch(node->lhs, !jump_if, label);
+    return;
+  case NK_LOGAND:
+  case NK_LOGOR: {
+    // a && b jumps if both are true, and skips b if a is false
+    bool all = node->kind == NK_LOGAND;
+    if (jump_if == all) {
+      int skip = new_label();
+      gen_branch(node->lhs, !jump_if, skip);
+      gen_branch(node->rhs, jump_if, label);
+      emit_label(skip);
+    } else {
+      gen_branch(node->lhs, jump_if, label);
+      gen_branch(node->rhs, jump_if, label);
+    }
+    return;
+  }
+  default:
+    break;
+  }
+
+  if (is_comparison(node) && !get_mark(node)) {
+    gen_compare(node);
+    char *code = jump_if ? cond_code[node->kind] : inverse_code[node->kind];
+    char insn[8];
+    snprintf(insn, sizeof(insn), "b%s", code);
+    emit_jump(insn, label);
+    return;
+  }
+
+  gen_expr(node);
+  emit_jump(jump_if ? "cbnz x0," : "cbz x0,", label);
+}
+
+// Jumps to `label` if the condition of statement `node` is `jump_if`. When
+// instrumenting, it is materialised to count which way it goes.
+static void gen_cond_branch(Node *node, bool jump_if, int label) {
+  if (!opt->instrument) {
+    gen_branch(node->cond, jump_if, label);
+    return;
+  }
+  gen_expr(node->cond);
+  emit("    cmp x0, #0\n");
+  gen_count_branch(node);
+  emit_jump(jump_if ? "bne" : "beq", label);
+}
+
+// -fprofile-use
+//
+// With a profile, the more frequent side of a branch falls through, and a
+// side taken at most once every COLD_RATIO times the other is moved out of
+// line, after the epilogue of the function. Cold blocks are generated into
+// a buffer of their own, which gen_func() appends to the function. Loops
+// whose body usually runs more than once are rotated to test at the
+// bottom, so that every iteration takes one branch instead of two.
+
+#define COLD_RATIO 10
+
+static ProfileSite *branch_profile(Node *node) {
+  return opt->profile ? find_profile_site(opt->profile, node->token) : NULL;
+}
+
+static bool is_cold(long count, long other) {
+  return other > 0 && count * COLD_RATIO <= other;
+}
+
+// Generates `stmt` at `label` in the cold section, continuing at `resume`.
+static void gen_cold_block(Node *stmt, int label, int resume) {
+  if (!cold_out) cold_out = open_memstream(&cold_buf, &cold_len);
+  FILE *hot_out = out;
+  out = cold_out;
+
+  // blocks within a cold block are already out of line
+  in_cold = true;
+  emit_label(label);
+  gen_stmt(stmt);
+  emit_jump("b", resume);
+  in_cold = false;
+
+  out = hot_out;
+}
+
+// If-conversion
+//
+// An if statement assigning the same local in both its branches, or in its
+// only one,
+//
+//   if (<cond>) x = <a>; else x = <b>;
+//   if (<cond>) x = <a>;
+//
+// becomes x = <cond> ? <a> : <b> (or x), computed without a branch by a
+// csel, or by a cset, csinc or csneg when <a> and <b> are 1 and 0, or one
+// of them is the other plus 1 or negated. Both values are computed
+// whichever way the condition goes, so they may only consist of numbers,
+// variables and arithmetic, which can't fault or have side effects (sdiv
+// by zero gives zero), of at most SELECT_MAX_NODES nodes in all. Branches
+// a profile shows going mostly one way are predicted well and kept, and so
+// are the ones counted when instrumenting.
+
+#define SELECT_MAX_NODES 8
+// values held by a select: the operands of the comparison, and <a> and <b>
+#define SELECT_OPERANDS 4
+
+// Returns the assignment to a scalar local that `stmt` consists of, or
+// NULL.
+static Node *single_assign(Node *stmt) {
+  if (stmt->kind == NK_COMPOUND_STMT && stmt->body && !stmt->body->next)
+    stmt = stmt->body;
+  if (stmt->kind != NK_EXPR_STMT || stmt->lhs->kind != NK_ASSIGN) return NULL;
+  Node *var = stmt->lhs->lhs;
+  if (var->kind != NK_VAR || var->type->kind == TYK_ARRAY) return NULL;
+  return stmt->lhs;
+}
+
+static bool count_node(Node *node, void *count) {
+  return --*(int *)count < 0;
+}
+
+static bool is_unsafe(Node *node, void *arg) {
+  return is_assignment(node) || node->kind == NK_DEREF ||
+         node->kind == NK_FUNC_CALL;
+}
+
+static char *reg_name(int reg) {
+  char *name = allocate(4);
+  snprintf(name, 4, "x%d", reg);
+  return name;
+}
+
+// Returns whether `a` and `b` are the same number or variable.
+static bool same_leaf(Node *a, Node *b) {
+  if (a->kind == NK_NUM) return is_num(b, a->val);
+  return a->kind == NK_VAR && is_var(b, a->var);
+}
+
+// Generates if statement `node` as a select if it can be. Returns whether
+// it was.
+static bool gen_select(Node *node) {
+  Node *then = single_assign(node->lhs);
+  Node *els = node->rhs ? single_assign(node->rhs) : NULL;
+  if (!then || (node->rhs && (!els || els->lhs->var != then->lhs->var)))
+    return false;
+
+  Node *a = then->rhs;
+  Node *b = els ? els->rhs : then->lhs;
+  int budget = SELECT_MAX_NODES;
+  if (visit(a, is_unsafe, NULL) || visit(b, is_unsafe, NULL) ||
+      visit(a, count_node, &budget) || (els && visit(b, count_node, &budget)))
+    return false;
+
+  // x = <cond> ? <t> : <f> is generated as
+  //
+  //   cmp <lhs>, <rhs>
+  //   <insn> x0, <t>, <f>, <code>
+  //
+  // where <t> and <f> are left out for a cset, and the same for a csinc
+  // or csneg, which select <t> if the condition holds and <f> + 1 or -<f>
+  // if not.
+  Node *cond = node->cond;
+  CseMark *mark = get_mark(cond);
+  if (mark && mark->save) return false;
+  Node *operands[SELECT_OPERANDS] = {cond};
+  bool compare = is_comparison(cond) && !mark;
+  if (compare) {
+    operands[0] = cond->lhs;
+    operands[1] = cond->rhs;
+  }
+  char *code = compare ? cond_code[cond->kind] : "ne";
+  char *inverse = compare ? inverse_code[cond->kind] : "eq";
+
+  char *insn = "csel";
+  Node *t = a, *f = b;
+  if (is_num(a, 1) && is_num(b, 0)) {
+    insn = "cset";
+  } else if (is_num(a, 0) && is_num(b, 1)) {
+    insn = "cset";
+    code = inverse;
+  } else if (a->kind == NK_ADD && is_num(a->rhs, 1) && same_leaf(a->lhs, b)) {
+    insn = "csinc";
+    t = f = b;
+    code = inverse;
+  } else if (b->kind == NK_ADD && is_num(b->rhs, 1) && same_leaf(b->lhs, a)) {
+    insn = "csinc";
+    t = f = a;
+  } else if (a->kind == NK_NEG && same_leaf(a->lhs, b)) {
+    insn = "csneg";
+    t = f = b;
+    code = inverse;
+  } else if (b->kind == NK_NEG && same_leaf(b->lhs, a)) {
+    insn = "csneg";
+    t = f = a;
+  }
+  bool cset = !strcmp(insn, "cset");
+  if (!cset) {
+    operands[2] = t;
+    if (f != t) operands[3] = f;
+  }
+
+  // the operands are computed in order into temporaries, except for a
+  // small number compared with, which is an immediate
+  Node *rhs = operands[1];
+  bool imm = !rhs || (rhs->kind == NK_NUM && rhs->val >= 0 && rhs->val < 4096);
+  if (rhs && imm) operands[1] = NULL;
+
+  int held = temp_depth;
+  for (int i = 0; i < SELECT_OPERANDS; i++) {
+    if (!operands[i]) continue;
+    int n = is_leaf(operands[i]) ? 1 : MAX(operands[i]->need, 1);
+    if (held + n > NUM_TEMPS) return false;
+    held++;
+  }
+
+  char *regs[SELECT_OPERANDS] = {0};
+  int base = temp_depth;
+  for (int i = 0; i < SELECT_OPERANDS; i++) {
+    if (!operands[i]) continue;
+    if (operands[i]->kind == NK_VAR && operands[i]->var->reg) {
+      regs[i] = reg_name(operands[i]->var->reg);
+      continue;
+    }
+    regs[i] = temp_regs[temp_depth++];
+    if (is_leaf(operands[i])) {
+      gen_leaf(operands[i], regs[i]);
+    } else {
+      gen_expr(operands[i]);
+      emit("    mov %s, x0\n", regs[i]);
+    }
+  }
+  temp_depth = base;
+
+  Obj *var = then->lhs->var;
+  char *dest = var->reg ? reg_name(var->reg) : "x0";
+  if (imm) emit("    cmp %s, #%d\n", regs[0], rhs ? rhs->val : 0);
+  else emit("    cmp %s, %s\n", regs[0], regs[1]);
+  if (cset) {
+    emit("    cset %s, %s\n", dest, code);
+  } else {
+    char *t_reg = regs[2];
+    char *f_reg = regs[f == t ? 2 : 3];
+    emit("    %s %s, %s, %s, %s\n", insn, dest, t_reg, f_reg, code);
+  }
+  if (!var->reg) gen_store_var("x0", var);
+  return true;
+}
+
+static void gen_if(Node *node) {
+  ProfileSite *profile = in_cold ? NULL : branch_profile(node);
+  bool biased = profile && (is_cold(profile->taken, profile->not_taken) ||
+                            is_cold(profile->not_taken, profile->taken));
+  if (!opt->instrument && !biased && gen_select(node)) return;
+
+  int end = new_label();
+
+  if (profile && is_cold(profile->taken, profile->not_taken)) {
+    int then = new_label();
+    gen_cond_branch(node, true, then);
+    if (node->rhs) gen_stmt(node->rhs);
+    emit_label(end);
+    gen_cold_block(node->lhs, then, end);
+    return;
+  }
+
+  if (profile && node->rhs && is_cold(profile->not_taken, profile->taken)) {
+    int els = new_label();
+    gen_cond_branch(node, false, els);
+    gen_stmt(node->lhs);
+    emit_label(end);
+    gen_cold_block(node->rhs, els, end);
+    return;
+  }
+
+  if (!node->rhs) {
+    gen_cond_branch(node, false, end);
+    gen_stmt(node->lhs);
+    emit_label(end);
+    return;
+  }
+
+  // the else branch falls through if it is the more frequent one
+  bool invert = profile && profile->not_taken > profile->taken;
+  int other = new_label();
+  gen_cond_branch(node, invert, other);
+  gen_stmt(invert ? node->rhs : node->lhs);
+  emit_jump("b", end);
+  emit_label(other);
+  gen_stmt(invert ? node->lhs : node->rhs);
+  emit_label(end);
+}
+
+// Generates a while or for loop; a while loop has no init and update.
+static void gen_loop(Node *node) {
+  ProfileSite *profile = node->cond ? branch_profile(node) : NULL;
+  int top = new_label();
+  int end = new_label();
+  int outer_break = break_label;
+  break_label = end;
+
+  if (node->lhs) gen_void_expr(node->lhs);
+
+  if (profile && profile->taken > profile->not_taken) {
+    int test = new_label();
+    emit_jump("b", test);
+    emit_label(top);
+    gen_stmt(node->body);
+    if (node->rhs) gen_void_expr(node->rhs);
+    emit_label(test);
+    gen_cond_branch(node, true, top);
+    emit_label(end);
+    break_label = outer_break;
+    return;
+  }
+
+  emit_label(top);
+  if (node->cond) gen_cond_branch(node, false, end);
+  gen_stmt(node->body);
+  if (node->rhs) gen_void_expr(node->rhs);
+  emit_jump("b", top);
+  emit_label(end);
+  break_label = outer_break;
+}
+
+// Switch statements
+//
+// The cases of a switch are sorted by value and dispatched on with a
+// bounds-checked jump table when there are at least JUMP_TABLE_MIN_CASES
+// of them and they fill at least a third of the range from the smallest
+// to the largest. Other ones are dispatched on by a balanced tree of
+// comparisons, which compares with the cases one by one once at most
+// CASE_TREE_LEAF of them are left.
+
+#define JUMP_TABLE_MIN_CASES 4
+#define CASE_TREE_LEAF 3
+
+typedef struct {
+  long val;
+  int label;
+  Node *node;
+} Case;
+
+typedef struct {
+  Case *cases;
+  int num_cases;
+  int cap;
+  int default_label;
+} Switch;
+
+// the switch statement whose body is being generated
+static _Thread_local Switch *current_switch;
+
+static int compare_cases(const void *a, const void *b) {
+  const Case *x = a, *y = b;
+  if (x->val != y->val) return x->val < y->val ? -1 : 1;
+  return 0;
+}
+
+// Adds the case and default labels within statement `node` to `sw`,
+// except for the ones of switches nested in it.
+static void collect_cases(Switch *sw, Node *node) {
+  for (; node->kind == NK_CASE_STMT || node->kind == NK_DEFAULT_STMT;
+       node = node->lhs) {
+    if (node->kind == NK_DEFAULT_STMT) {
+      sw->default_label = new_label();
+      continue;
+    }
+    if (sw->num_cases == sw->cap) {
+      sw->cap = sw->cap ? sw->cap * 2 : 16;
+      Case *cases = allocate(sw->cap * sizeof(Case));
+      if (sw->num_cases)
+        memcpy(cases, sw->cases, sw->num_cases * sizeof(Case));
+      sw->cases = cases;
+    }
+    sw->cases[sw->num_cases++] =
+      (Case){node->val, new_label(), node};
+  }
+
+  switch (node->kind) {
+  case NK_COMPOUND_STMT:
+    for (Node *stmt = node->body; stmt; stmt = stmt->next)
+      collect_cases(sw, stmt);
+    return;
+  case NK_IF_STMT:
+    collect_cases(sw, node->lhs);
+    if (node->rhs) collect_cases(sw, node->rhs);
+    return;
+  case NK_WHILE_STMT:
+  case NK_FOR_STMT:
+    collect_cases(sw, node->body);
+    return;
+  default:
+    return;
+  }
+}
+
+static int case_label(Node *node) {
+  Case key = {node->val};
+  Case *c = bsearch(&key, current_switch->cases, current_switch->num_cases,
+                    sizeof(Case), compare_cases);
+  return c->label;
+}
+
+// Compares x0 with `val`, using x1 if it does not fit an immediate.
+static void gen_cmp_imm(long val) {
+  if (val >= 0 && val < 4096) {
+    emit("    cmp x0, #%ld\n", val);
+  } else if (val < 0 && val > -4096) {
+    emit("    cmn x0, #%ld\n", -val);
+  } else {
+    emit("    mov x1, #%ld\n", val);
+    emit("    cmp x0, x1\n");
+  }
+}
+
+// Jumps to the label of the case among cases[lo] to cases[hi - 1] of `sw`
+// equal to x0, or to the default label if there is none.
+static void gen_case_tree(Switch *sw, int lo, int hi) {
+  if (hi - lo <= CASE_TREE_LEAF) {
+    for (int i = lo; i < hi; i++) {
+      gen_cmp_imm(sw->cases[i].val);
+      emit_jump("beq", sw->cases[i].label);
+    }
+    emit_jump("b", sw->default_label);
+    return;
+  }
+
+  int mid = (lo + hi) / 2;
+  int below = new_label();
+  gen_cmp_imm(sw->cases[mid].val);
+  emit_jump("beq", sw->cases[mid].label);
+  emit_jump("blt", below);
+  gen_case_tree(sw, mid + 1, hi);
+  emit_label(below);
+  gen_case_tree(sw, lo, mid);
+}
+
+// Jumps to the label of the case of `sw` equal to x0 through a table of
+// the offsets of the labels of every value from the smallest case to the
+// largest, or to the default label if x0 is out of its range.
+static void gen_jump_table(Switch *sw) {
+  long min = sw->cases[0].val;
+  long len = sw->cases[sw->num_cases - 1].val - min + 1;
+  int table = new_label();
+
+  if (min > 0 && min < 4096) {
+    emit("    sub x0, x0, #%ld\n", min);
+  } else if (min < 0 && min > -4096) {
+    emit("    add x0, x0, #%ld\n", -min);
+  } else if (min) {
+    emit("    mov x1, #%ld\n", min);
+    emit("    sub x0, x0, x1\n");
+  }
+  // values below the smallest case wrap around to large unsigned ones
+  gen_cmp_imm(len - 1);
+  emit_jump("bhi", sw->default_label);
+  emit_jump("adr x1,", table);
+  emit("    ldrsw x2, [x1, x0, lsl #2]\n");
+  emit("    add x1, x1, x2\n");
+  emit("    br x1\n");
+
+  emit_label(table);
+  Case *c = sw->cases;
+  for (long val = min; val < min + len; val++) {
+    emit("    .long ");
+    print_label(c->val == val ? (c++)->label : sw->default_label);
+    emit(" - ");
+    print_label(table);
+    emit("\n");
+  }
+}
+
+static void gen_switch(Node *node) {
+  Switch sw = {0};
+  int end = new_label();
+  collect_cases(&sw, node->body);
+  if (!sw.default_label) sw.default_label = end;
+
+  qsort(sw.cases, sw.num_cases, sizeof(Case), compare_cases);
+  for (int i = 1; i < sw.num_cases; i++)
+    if (sw.cases[i].val == sw.cases[i - 1].val)
+      error_at(sw.cases[i].node->token->loc, "duplicate case value");
+
+  gen_expr(node->cond);
+  int n = sw.num_cases;
+  if (n >= JUMP_TABLE_MIN_CASES &&
+      sw.cases[n - 1].val - sw.cases[0].val < 3L * n)
+    gen_jump_table(&sw);
+  else
+    gen_case_tree(&sw, 0, n);
+
+  Switch *outer = current_switch;
+  int outer_break = break_label;
+  current_switch = &sw;
+  break_label = end;
+  gen_stmt(node->body);
+  current_switch = outer;
+  break_label = outer_break;
+  emit_label(end);
+}
+
+// -fvectorize
+//
+// Innermost counted loops of the form
+//
+//   for (i = <init>; i < <n>; i++) { a[i] = <expr>; s = s + <expr>; }
+//
+// where i++ may also be i = i + 1 or i += 1, s = s + <expr> may be
+// s += <expr>, and every statement either stores to the element i of a local int
+// array or adds to a variable used nowhere else in the loop, and <expr>
+// combines elements b[i] of local int arrays, numbers and other variables
+// with +, - and comparisons, run two iterations at a time in NEON registers
+// (ints are 64 bits, so a 128-bit register holds two). Sums are kept in a
+// vector register per variable and added up after the loop. The original
+// loop then runs the iterations left over. Since every statement only
+// touches element i, running the statements for two elements at once
+// gives the same results. NEON has no 64-bit integer multiply or divide,
+// so loops that multiply or divide are left alone. So are all loops when
+// instrumenting, so that the counts of a profile are those of the source.
+
+// vector registers; sums take registers from the top, and expressions are
+// evaluated in the rest but v8 to v15, whose low halves d8 to d15 the callee
+// saves
+#define VECTOR_REGS 32
+#define MAX_SUMS 4
+
+// Returns the register holding the value of an expression `depth` operands
+// down.
+static int vector_reg(int depth) {
+  return depth < 8 ? depth : depth + 8;
+}
+
+static void remark(Node *node, char *fmt, ...) {
+  if (!remarks_out) return;
+  fprintf(remarks_out, "%d:%d: ", node->token->line, node->token->col);
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(remarks_out, fmt, ap);
+  va_end(ap);
+  fprintf(remarks_out, "\n");
+}
+
+// Returns whether `node` is a[i] for a local int array a and the
+// induction variable i.
+static bool is_element(Node *node, Obj *iv) {
+  if (node->kind != NK_DEREF || node->lhs->kind != NK_ADD) return false;
+  Node *base = node->lhs->lhs;
+  Node *index = node->lhs->rhs;
+  return base->kind == NK_VAR && base->var->type->kind == TYK_ARRAY &&
+         is_integer(base->var->type->base) && index->kind == NK_MUL &&
+         is_var(index->lhs, iv) && is_num(index->rhs, 8);
+}
+
+// If `node` is s = s + <expr>, or more generally s = s + x - y ..., for an
+// int variable s other than the induction variable, returns the leaf s on
+// the right-hand side, and NULL otherwise. The value added to s is the
+// right-hand side with that leaf taken as 0. For s += <expr>, it is the
+// right-hand side as it is, and the leaf returned is the lhs.
+static Node *sum_leaf(Node *node, Obj *iv) {
+  if ((node->kind != NK_ASSIGN && node->kind != NK_ADD_ASSIGN) ||
+      node->lhs->kind != NK_VAR)
+    return NULL;
+  Obj *var = node->lhs->var;
+  if (var == iv || !is_integer(var->type)) return NULL;
+  if (node->kind == NK_ADD_ASSIGN) return node->lhs;
+
+  Node *leaf = node->rhs;
+  if (leaf->kind != NK_ADD && leaf->kind != NK_SUB) return NULL;
+  while (leaf->kind == NK_ADD || leaf->kind == NK_SUB) leaf = leaf->lhs;
+  return is_var(leaf, var) ? leaf : NULL;
+}
+
+// The sums of the loop being checked or generated, and the leaf taken as 0
+// in the statement being checked or generated
+static _Thread_local Obj *sums[MAX_SUMS];
+static _Thread_local int num_sums;
+static _Thread_local Node *zero_leaf;
+
+static bool is_sum_var(Obj *var) {
+  for (int i = 0; i < num_sums; i++)
+    if (sums[i] == var) return true;
+  return false;
+}
+
+// Returns why `node` cannot be evaluated in vector registers from
+// vector_reg(depth) on, or NULL if it can.
+static char *check_vector_expr(Node *node, Obj *iv, int depth) {
+  if (vector_reg(depth) >= VECTOR_REGS - num_sums)
+    return "expression is too deep";
+
+  switch (node->kind) {
+  case NK_NUM:
+    return NULL;
+  case NK_VAR:
+    if (node == zero_leaf) return NULL;
+    if (node->var == iv) return "uses the induction variable as a value";
+    if (is_sum_var(node->var)) return "uses a sum inside the loop";
+    if (!is_integer(node->type)) return "uses a non-int variable";
+    return NULL;
+  case NK_DEREF:
+    if (!is_element(node, iv)) return "accesses memory other than a[i]";
+    return NULL;
+  case NK_ADD:
+  case NK_SUB:
+  case NK_EQ:
+  case NK_NE:
+  case NK_LT:
+  case NK_LE:
+  case NK_GT:
+  case NK_GE: {
+    if (!is_integer(node->lhs->type) || !is_integer(node->rhs->type))
+      return "uses pointer arithmetic";
+    char *reason = check_vector_expr(node->lhs, iv, depth);
+    return reason ? reason : check_vector_expr(node->rhs, iv, depth + 1);
+  }
+  case NK_MUL:
+  case NK_DIV:
+    return "NEON has no 64-bit integer multiply or divide";
+  case NK_FUNC_CALL:
+    return "contains a call";
+  default:
+    return "contains an unsupported expression";
+  }
+}
+
+// Returns why loop `node` cannot be vectorised, or NULL if it can. Sets
+// `*iv` to its induction variable.
+static char *check_vector_loop(Node *node, Obj **iv) {
+  if (opt->instrument) return "counting branches for -finstrument";
+
+  // i = <init>, i++
+  Node *init = node->lhs;
+  Node *update = node->rhs;
+  if (!init || !node->cond || !update) return "not a counted loop";
+  if (init->kind != NK_ASSIGN || init->lhs->kind != NK_VAR)
+    return "no induction variable";
+  *iv = init->lhs->var;
+  if (!is_integer((*iv)->type)) return "no induction variable";
+  int step;
+  if (!is_step(update, *iv, &step) || step != 1)
+    return "induction variable does not step by 1";
+
+  // i < <n> or i <= <n>, where <n> is a number or another variable
+  Node *cond = node->cond;
+  if ((cond->kind != NK_LT && cond->kind != NK_LE) ||
+      !is_var(cond->lhs, *iv))
+    return "condition is not i < n";
+  Node *limit = cond->rhs;
+  if (limit->kind != NK_NUM &&
+      (limit->kind != NK_VAR || limit->var == *iv ||
+       !is_integer(limit->type)))
+    return "loop bound is not a number or variable";
+
+  // a[i] = <expr>; s = s + <expr>; ..., where a lone statement is not
+  // part of a list
+  Node *body = node->body;
+  Node *stmts = body->kind == NK_COMPOUND_STMT ? body->body : body;
+  if (!stmts) return "empty body";
+  num_sums = 0;
+  for (Node *stmt = stmts; stmt; stmt = stmt->next) {
+    if (stmt->kind == NK_FOR_STMT || stmt->kind == NK_WHILE_STMT)
+      return "not an innermost loop";
+    if (stmt->kind != NK_EXPR_STMT || !is_assignment(stmt->lhs))
+      return "body is not a sequence of a[i] = ... or s = s + ... statements";
+    Node *assign = stmt->lhs;
+    if (assign->kind == NK_ASSIGN && is_element(assign->lhs, *iv)) continue;
+    if (!sum_leaf(assign, *iv))
+      return "body is not a sequence of a[i] = ... or s = s + ... statements";
+    if (is_sum_var(assign->lhs->var) || num_sums == MAX_SUMS)
+      return "too many sums";
+    sums[num_sums++] = assign->lhs->var;
+  }
+  if (limit->kind == NK_VAR && is_sum_var(limit->var))
+    return "loop bound changes in the loop";
+
+  for (Node *stmt = stmts; stmt; stmt = stmt->next) {
+    zero_leaf = sum_leaf(stmt->lhs, *iv);
+    char *reason = check_vector_expr(stmt->lhs->rhs, *iv, 0);
+    zero_leaf = NULL;
+    if (reason) return reason;
+  }
+  return NULL;
+}
+
+// Puts the address of element a[i] into x9, given i in x10.
+static void gen_element_addr(Node *node) {
+  emit("    add x9, fp, #%d\n", node->lhs->lhs->var->offset);
+  emit("    add x9, x9, x10, lsl #3\n");
+}
+
+// Evaluates `node` into v<vector_reg(depth)>, given i in x10.
+static void gen_vector_expr(Node *node, int depth) {
+  int reg = vector_reg(depth);
+  switch (node->kind) {
+  case NK_NUM:
+    emit("    mov x11, #%d\n", node->val);
+    emit("    dup v%d.2d, x11\n", reg);
+    return;
+  case NK_VAR:
+    if (node == zero_leaf) {
+      emit("    movi v%d.2d, #0\n", reg);
+      return;
+    }
+    gen_load_var("x11", node->var);
+    emit("    dup v%d.2d, x11\n", reg);
+    return;
+  case NK_DEREF:
+    gen_element_addr(node);
+    emit("    ldr q%d, [x9]\n", reg);
+    return;
+  default:
+    break;
+  }
+
+  gen_vector_expr(node->lhs, depth);
+  gen_vector_expr(node->rhs, depth + 1);
+  int a = reg, b = vector_reg(depth + 1);
+
+  switch (node->kind) {
+  case NK_ADD:
+    emit("    add v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    return;
+  case NK_SUB:
+    emit("    sub v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    return;
+  case NK_EQ:
+    emit("    cmeq v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    break;
+  case NK_NE:
+    emit("    cmeq v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    emit("    mvn v%d.16b, v%d.16b\n", reg, reg);
+    break;
+  case NK_LT:
+    emit("    cmgt v%d.2d, v%d.2d, v%d.2d\n", reg, b, a);
+    break;
+  case NK_LE:
+    emit("    cmge v%d.2d, v%d.2d, v%d.2d\n", reg, b, a);
+    break;
+  case NK_GT:
+    emit("    cmgt v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    break;
+  case NK_GE:
+    emit("    cmge v%d.2d, v%d.2d, v%d.2d\n", reg, a, b);
+    break;
+  default:
+    error_at(node->token->loc, "invalid expression");
+  }
+
+  // comparisons set true lanes to all ones, that is -1; C wants 1
+  emit("    neg v%d.2d, v%d.2d\n", reg, reg);
+}
+
+// Generates loop `node` vectorised if it can be. Returns whether it was.
+static bool gen_vector_loop(Node *node) {
+  Obj *iv;
+  char *reason = check_vector_loop(node, &iv);
+  if (reason) {
+    remark(node, "loop not vectorised: %s", reason);
+    return false;
+  }
+  remark(node, "loop vectorised");
+
+  int top = new_label();
+  int rest = new_label();
+  gen_expr(node->lhs);
+  for (int i = 0; i < num_sums; i++)
+    emit("    movi v%d.2d, #0\n", VECTOR_REGS - 1 - i);
+
+  // run two iterations while i + 1 satisfies the condition as well
+  emit_label(top);
+  gen_expr(node->cond->rhs);
+  emit("    mov x1, x0\n");
+  gen_load_var("x0", iv);
+  emit("    add x0, x0, #1\n");
+  emit("    cmp x0, x1\n");
+  emit_jump(node->cond->kind == NK_LT ? "bge" : "bgt", rest);
+
+  Node *body = node->body;
+  Node *stmts = body->kind == NK_COMPOUND_STMT ? body->body : body;
+  for (Node *stmt = stmts; stmt; stmt = stmt->next) {
+    Node *assign = stmt->lhs;
+    gen_load_var("x10", iv);
+    if (is_element(assign->lhs, iv)) {
+      gen_vector_expr(assign->rhs, 0);
+      gen_element_addr(assign->lhs);
+      emit("    str q0, [x9]\n");
+      continue;
+    }
+
+    int acc = 0;
+    while (sums[acc] != assign->lhs->var) acc++;
+    zero_leaf = sum_leaf(assign, iv);
+    gen_vector_expr(assign->rhs, 0);
+    zero_leaf = NULL;
+    emit("    add v%d.2d, v%d.2d, v0.2d\n", VECTOR_REGS - 1 - acc,
+         VECTOR_REGS - 1 - acc);
+  }
+
+  gen_load_var("x0", iv);
+  emit("    add x0, x0, #2\n");
+  gen_store_var("x0", iv);
+  emit_jump("b", top);
+
+  // add the lanes of every sum to its variable, then run the remaining
+  // iterations, continuing from i
+  emit_label(rest);
+  for (int i = 0; i < num_sums; i++) {
+    int acc = VECTOR_REGS - 1 - i;
+    emit("    addp d%d, v%d.2d\n", acc, acc);
+    emit("    fmov x0, d%d\n", acc);
+    gen_load_var("x1", sums[i]);
+    emit("    add x0, x1, x0\n");
+    gen_store_var("x0", sums[i]);
+  }
+  Node scalar = *node;
+  scalar.lhs = NULL;
+  gen_loop(&scalar);
+  return true;
+}
+
+// -funroll-loops
+//
+// Loops of the form
+//
+//   for (<init>; i < <n>; i = i + <step>) <body>
+//   while (i < <n>) { ...; i = i + <step>; }
+//
+// where the update may also be i += <step>, i++ or their decrementing
+// forms, the condition may also be <=, or > and >= for loops stepping down,
+// <n> is a number or a variable, neither i nor <n> is assigned in the
+// body, and the function takes the address of no local, run a number of
+// times known on entry. Such loops with a number for both i = <init> and
+// <n> that run at most FULL_UNROLL_TRIPS times become that many copies of
+// the body, without any tests. Other ones run opt->unroll copies of the
+// body per test of whether that many iterations are left, and then the
+// original loop runs the iterations left over. Loops are left alone when
+// instrumenting, so that the counts of a profile are those of the source,
+// and when a break may leave them or they hold labels of a switch.
+
+#define FULL_UNROLL_TRIPS 8
+// most nodes in all the copies of a loop body
+#define UNROLL_MAX_NODES 512
+
+typedef struct {
+  Obj *iv;
+  Node *limit;
+  // the condition, i <cmp> <n>
+  NodeKind cmp;
+  int step;
+  Node *update;
+  // the statements of the body other than the update, from `body` up to
+  // (excluding) `body_end`
+  Node *body;
+  Node *body_end;
+} CountedLoop;
+
+// Calls `fn` on `node` and every node within it until `fn` returns true.
+// Returns whether it did.
+static bool visit(Node *node, bool (*fn)(Node *, void *), void *arg) {
+  for (; node; node = node->lhs) {
+    if (fn(node, arg)) return true;
+
+    switch (node->kind) {
+    case NK_NUM:
+    case NK_VAR:
+    case NK_NULL_STMT:
+    case NK_BREAK_STMT:
+      return false;
+    case NK_FUNC_CALL:
+      for (Node *arg_node = node->args; arg_node; arg_node = arg_node->next)
+        if (visit(arg_node, fn, arg)) return true;
+      return false;
+    case NK_COMPOUND_STMT:
+      for (Node *stmt = node->body; stmt; stmt = stmt->next)
+        if (visit(stmt, fn, arg)) return true;
+      return false;
+    case NK_IF_STMT:
+      if (visit(node->cond, fn, arg) || visit(node->rhs, fn, arg))
+        return true;
+      break;
+    case NK_WHILE_STMT:
+    case NK_FOR_STMT:
+    case NK_SWITCH_STMT:
+      if (visit(node->cond, fn, arg) || visit(node->rhs, fn, arg) ||
+          visit(node->body, fn, arg))
+        return true;
+      break;
+    default:
+      if (visit(node->rhs, fn, arg)) return true;
+    }
+  }
+  return false;
+}
+
+static bool assigns(Node *node, void *var) {
+  return is_assignment(node) && is_var(node->lhs, var);
+}
+
+// Returns whether loop `node` is a counted loop, and if so, describes it
+// in `loop`.
+static bool is_counted_loop(Node *node, CountedLoop *loop) {
+  Node *cond = node->cond;
+  if (!cond) return false;
+  if (cond->kind != NK_LT && cond->kind != NK_LE && cond->kind != NK_GT &&
+      cond->kind != NK_GE)
+    return false;
+  if (cond->lhs->kind != NK_VAR || !is_integer(cond->lhs->type))
+    return false;
+  Obj *iv = cond->lhs->var;
+  Node *limit = cond->rhs;
+  if (limit->kind != NK_NUM &&
+      (limit->kind != NK_VAR || limit->var == iv ||
+       !is_integer(limit->type)))
+    return false;
+  if (addresses_taken) return false;
+
+  loop->iv = iv;
+  loop->limit = limit;
+  loop->cmp = cond->kind;
+
+  if (node->kind == NK_FOR_STMT) {
+    loop->update = node->rhs;
+    loop->body = node->body;
+    loop->body_end = NULL;
+  } else {
+    // the update is the last statement of the body
+    Node *body = node->body;
+    if (body->kind != NK_COMPOUND_STMT || !body->body) return false;
+    Node *last = body->body;
+    while (last->next) last = last->next;
+    if (last->kind != NK_EXPR_STMT) return false;
+    loop->update = last->lhs;
+    loop->body = body->body;
+    loop->body_end = last;
+  }
+
+  // i = i + <step>, i += <step>, i++ and the like, towards <n>
+  if (!loop->update || !is_step(loop->update, iv, &loop->step))
+    return false;
+  bool up = loop->cmp == NK_LT || loop->cmp == NK_LE;
+  if (up ? loop->step <= 0 : loop->step >= 0) return false;
+
+  for (Node *stmt = loop->body; stmt != loop->body_end; stmt = stmt->next) {
+    if (visit(stmt, assigns, iv)) return false;
+    if (limit->kind == NK_VAR && visit(stmt, assigns, limit->var))
+      return false;
+  }
+  return true;
+}
+
+static bool holds(NodeKind cmp, long i, long n) {
+  switch (cmp) {
+  case NK_LT:
+    return i < n;
+  case NK_LE:
+    return i <= n;
+  case NK_GT:
+    return i > n;
+  default:
+    return i >= n;
+  }
+}
+
+// Returns how many times for loop `node` runs if that is known and at most
+// FULL_UNROLL_TRIPS, and -1 otherwise.
+static int trip_count(Node *node, CountedLoop *loop) {
+  Node *init = node->lhs;
+  if (node->kind != NK_FOR_STMT || !init || init->kind != NK_ASSIGN ||
+      !is_var(init->lhs, loop->iv) || init->rhs->kind != NK_NUM ||
+      loop->limit->kind != NK_NUM)
+    return -1;
+
+  long i = init->rhs->val;
+  for (int trips = 0; trips <= FULL_UNROLL_TRIPS; trips++) {
+    if (!holds(loop->cmp, i, loop->limit->val)) return trips;
+    i += loop->step;
+  }
+  return -1;
+}
+
+// Generates the body of `loop` followed by its update.
+static void gen_iteration(CountedLoop *loop) {
+  for (Node *stmt = loop->body; stmt != loop->body_end; stmt = stmt->next) {
+    gen_stmt(stmt);
+    assert(depth == 0);
+  }
+  gen_void_expr(loop->update);
+}
+
+// Returns whether statement `node` contains a case or default label of a
+// switch around it, or, if `breaks`, a break out of it. Such statements
+// can't be copied.
+static bool jumps_across(Node *node, bool breaks) {
+  switch (node->kind) {
+  case NK_BREAK_STMT:
+    return breaks;
+  case NK_CASE_STMT:
+  case NK_DEFAULT_STMT:
+    return true;
+  case NK_COMPOUND_STMT:
+    for (Node *stmt = node->body; stmt; stmt = stmt->next)
+      if (jumps_across(stmt, breaks)) return true;
+    return false;
+  case NK_IF_STMT:
+    return jumps_across(node->lhs, breaks) ||
+           (node->rhs && jumps_across(node->rhs, breaks));
+  case NK_WHILE_STMT:
+  case NK_FOR_STMT:
+    return jumps_across(node->body, false);
+  default:
+    return false;
+  }
+}
+
+// Generates loop `node` unrolled if it can be. Returns whether it was.
+static bool gen_unrolled_loop(Node *node) {
+  CountedLoop loop;
+  if (opt->instrument || !is_counted_loop(node, &loop) ||
+      jumps_across(node->body, true))
+    return false;
+
+  // the size of one copy of the body, counting up to UNROLL_MAX_NODES + 1
+  int budget = UNROLL_MAX_NODES;
+  for (Node *stmt = loop.body; stmt != loop.body_end; stmt = stmt->next)
+    if (visit(stmt, count_node, &budget)) break;
+  if (budget >= 0) visit(loop.update, count_node, &budget);
+  int size = UNROLL_MAX_NODES - budget;
+
+  int trips = trip_count(node, &loop);
+  if (trips >= 0 && trips * size <= UNROLL_MAX_NODES) {
+    gen_void_expr(node->lhs);
+    for (int i = 0; i < trips; i++) gen_iteration(&loop);
+    return true;
+  }
+  if (opt->unroll * size > UNROLL_MAX_NODES) return false;
+
+  int top = new_label();
+  int rest = new_label();
+  if (node->kind == NK_FOR_STMT && node->lhs) gen_void_expr(node->lhs);
+
+  // run opt->unroll iterations while the last of them satisfies the
+  // condition as well
+  char *exit_branch[] = {
+    [NK_LT] = "bge", [NK_LE] = "bgt", [NK_GT] = "ble", [NK_GE] = "blt",
+  };
+  emit_label(top);
+  gen_expr(loop.limit);
+  emit("    mov x1, x0\n");
+  gen_load_var("x0", loop.iv);
+  emit("    mov x2, #%d\n", (opt->unroll - 1) * loop.step);
+  emit("    add x0, x0, x2\n");
+  emit("    cmp x0, x1\n");
+  emit_jump(exit_branch[loop.cmp], rest);
+  for (int i = 0; i < opt->unroll; i++) gen_iteration(&loop);
+  emit_jump("b", top);
+
+  // run the remaining iterations, continuing from i
+  emit_label(rest);
+  Node scalar = *node;
+  scalar.lhs = NULL;
+  gen_loop(&scalar);
+  return true;
+}
+
+static void gen_stmt(Node *node) {
+  switch (node->kind) {
+    case NK_EXPR_STMT:
+      gen_void_expr(node->lhs);
+      return;
+    case NK_RETURN_STMT:
+      gen_expr(node->lhs);
+      emit_jump("b", RETURN_LABEL);
+      return;
+    case NK_COMPOUND_STMT:
+      for (Node *stmt = node->body; stmt; stmt = stmt->next) {
+        gen_stmt(stmt);
+        assert(depth == 0);
+      }
+      return;
+    case NK_NULL_STMT:
+      // do nothing
+      return;
+    case NK_IF_STMT:
+      gen_if(node);
+      return;
+    case NK_WHILE_STMT:
+      if (opt->unroll && gen_unrolled_loop(node)) return;
+      gen_loop(node);
+      return;
+    case NK_FOR_STMT:
+      if (opt->vectorize && gen_vector_loop(node)) return;
+      if (opt->unroll && gen_unrolled_loop(node)) return;
+      gen_loop(node);
+      return;
+    case NK_SWITCH_STMT:
+      gen_switch(node);
+      return;
+    case NK_CASE_STMT:
+      emit_label(case_label(node));
+      gen_stmt(node->lhs);
+      return;
+    case NK_DEFAULT_STMT:
+      emit_label(current_switch->default_label);
+      gen_stmt(node->lhs);
+      return;
+    case NK_BREAK_STMT:
+      emit_jump("b", break_label);
+      return;
+    default:
+      error_at(node->token->loc, "invalid statement");
+  }
+}
+
+static int align_to(int n, int align) {
+  return (n + align - 1) / align * align;
+}
+
+// Register promotion
+//
+// Scalar locals whose address is never taken are kept in the callee-saved
+// registers x19 to x28 instead of their stack slots, the most used first,
+// with uses within loops weighing more. Calls preserve these registers, so
+// the variables stay put across them, and every one that is used is saved
+// in the prologue and restored in the epilogue. Each variable has the same
+// register throughout the function, so control flow joins need no moves.
+//
+// Pointer arithmetic from the address of one local may reach the others, as
+// the locals are laid out next to each other, so functions taking the
+// address of any local keep all of them in memory.
+//
+// The value of an assignment is the address stored to (see store()), which
+// a variable in a register does not have, so variables assigned where that
+// value is used stay in memory.
+
+#define FIRST_SAVED_REG 19
+#define NUM_SAVED_REGS 10
+// weight of a use nested in as many loops as that or more
+#define MAX_LOOP_WEIGHT (1L << 24)
+
+// Adds `weight` to the weight of every variable used in `node`, where
+// `used` tells whether the value of `node` is used.
+static void weigh_uses(Node *node, long weight, bool used) {
+  long inner = weight < MAX_LOOP_WEIGHT ? weight * 8 : weight;
+
+  while (node) {
+    switch (node->kind) {
+    case NK_NUM:
+    case NK_NULL_STMT:
+    case NK_BREAK_STMT:
+      return;
+    case NK_VAR:
+      if (node->var->weight >= 0) node->var->weight += weight;
+      return;
+    case NK_ASSIGN:
+      if (node->lhs->kind == NK_VAR) {
+        Obj *var = node->lhs->var;
+        if (used) var->weight = -1;
+        else if (var->weight >= 0) var->weight += weight;
+      } else {
+        weigh_uses(node->lhs, weight, true);
+      }
+      node = node->rhs;
+      used = true;
+      break;
+    case NK_EXPR_STMT:
+      node = node->lhs;
+      used = false;
+      break;
+    case NK_FUNC_CALL:
+      for (Node *arg = node->args; arg; arg = arg->next)
+        weigh_uses(arg, weight, true);
+      return;
+    case NK_COMPOUND_STMT:
+      for (Node *stmt = node->body; stmt; stmt = stmt->next)
+        weigh_uses(stmt, weight, false);
+      return;
+    case NK_IF_STMT:
+      weigh_uses(node->cond, weight, true);
+      weigh_uses(node->lhs, weight, false);
+      node = node->rhs;
+      break;
+    case NK_WHILE_STMT:
+    case NK_FOR_STMT:
+      weigh_uses(node->lhs, weight, false);
+      weigh_uses(node->cond, inner, true);
+      weigh_uses(node->rhs, inner, false);
+      node = node->body;
+      weight = inner;
+      used = false;
+      break;
+    case NK_SWITCH_STMT:
+      weigh_uses(node->cond, weight, true);
+      node = node->body;
+      used = false;
+      break;
+    case NK_CASE_STMT:
+    case NK_DEFAULT_STMT:
+      node = node->lhs;
+      used = false;
+      break;
+    default:
+      weigh_uses(node->rhs, weight, true);
+      node = node->lhs;
+      used = true;
+    }
+  }
+}
+
+static bool is_promotable(Obj *var) {
+  return var->weight > 0 && !var->reg &&
+         (is_integer(var->type) || var->type->kind == TYK_PTR);
+}
+
+// Assigns registers to the locals of `fun` worth keeping in one. Returns
+// the number of registers used.
+static int promote_locals(Fun *fun) {
+  if (addresses_taken) return 0;
+  weigh_uses(fun->body, 1, false);
+
+  int num_regs = 0;
+  while (num_regs < NUM_SAVED_REGS) {
+    Obj *best = NULL;
+    for (Obj *var = fun->locals; var; var = var->next)
+      if (is_promotable(var) && (!best || var->weight > best->weight))
+        best = var;
+    if (!best) break;
+    best->reg = FIRST_SAVED_REG + num_regs++;
+  }
+  return num_regs;
+}
+
+// Value numbering, see gen_reuse()
+//
+// The nodes of a function are numbered in the order their code runs, with
+// a variable's number changing whenever it is assigned, so equal numbers
+// mean equal values. The values computed so far are kept on a stack, from
+// which the values computed within a branch or loop are dropped when it
+// ends, so only values computed on every path to a node are looked up.
+// Loops are entered with new numbers for the variables they assign, and
+// the values of the condition of a loop are not looked up in its body, as
+// rotated and unrolled loops run the body first. Functions taking the
+// address of a local are left alone, as any store may change any variable.
+
+// how many of the latest values a value is looked up among
+#define CSE_WINDOW 64
+
+typedef struct {
+  int kind;
+  long a;
+  long b;
+  long vn;
+} Value;
+
+typedef struct {
+  long vn;
+  Node *node;
+  // position and number of calls before `node`
+  int pos;
+  int epoch;
+} Avail;
+
+static _Thread_local Value *values;
+static _Thread_local int values_cap;
+static _Thread_local int num_values;
+
+static _Thread_local Avail *avail;
+static _Thread_local int avail_cap;
+static _Thread_local int num_avail;
+
+// positions count operators in the order their code runs; the epoch counts
+// calls, which clobber the registers, and labels
+static _Thread_local int cse_pos;
+static _Thread_local int cse_epoch;
+
+// the node whose value each register holds, the position it saves it at,
+// and the position of its last use
+static _Thread_local Node *reg_owner[NUM_CSE_REGS];
+static _Thread_local int reg_start[NUM_CSE_REGS];
+static _Thread_local int reg_busy[NUM_CSE_REGS];
+// registers holding values from before the innermost loop being numbered
+// which are used in it, kept until the outermost loop ends as every
+// iteration uses them; the position the innermost loop starts at, and how
+// many loops enclose the position being numbered. A value whose position
+// is at most the start of a loop is computed before it.
+static _Thread_local bool reg_pinned[NUM_CSE_REGS];
+static _Thread_local int cse_loop_start;
+static _Thread_local int cse_loop_depth;
+
+// Returns the number of operator `kind` applied to `a` and `b`.
+static long value_number(int kind, long a, long b) {
+  if (num_values * 2 >= values_cap) {
+    Value *old = values;
+    int old_cap = values_cap;
+    values_cap = values_cap ? values_cap * 2 : 256;
+    values = allocate(values_cap * sizeof(Value));
+    for (int i = 0; i < old_cap; i++) {
+      if (!old[i].vn) continue;
+      uint64_t h = hash_bytes(FNV_OFFSET, (char *)&old[i].a, sizeof(long));
+      h = hash_bytes(h, (char *)&old[i].b, sizeof(long)) + old[i].kind;
+      int j = h & (values_cap - 1);
+      while (values[j].vn) j = (j + 1) & (values_cap - 1);
+      values[j] = old[i];
+    }
+  }
+
+  uint64_t h = hash_bytes(FNV_OFFSET, (char *)&a, sizeof(long));
+  h = hash_bytes(h, (char *)&b, sizeof(long)) + kind;
+  int i = h & (values_cap - 1);
+  for (; values[i].vn; i = (i + 1) & (values_cap - 1))
+    if (values[i].kind == kind && values[i].a == a && values[i].b == b)
+      return values[i].vn;
+  values[i] = (Value){kind, a, b, ++num_values};
+  return num_values;
+}
+
+static void add_avail(long vn, Node *node) {
+  if (num_avail == avail_cap) {
+    avail_cap = avail_cap ? avail_cap * 2 : 64;
+    Avail *a = allocate(avail_cap * sizeof(Avail));
+    if (num_avail) memcpy(a, avail, num_avail * sizeof(Avail));
+    avail = a;
+  }
+  avail[num_avail++] = (Avail){vn, node, cse_pos, cse_epoch};
+}
+
+// Marks `node`, whose value number is `vn`, to take its value from a
+// register if an available node has computed it. Returns whether it does.
+static bool reuse(Node *node, long vn) {
+  int lo = num_avail > CSE_WINDOW ? num_avail - CSE_WINDOW : 0;
+  for (int i = num_avail - 1; i >= lo; i--) {
+    Avail *a = &avail[i];
+    if (a->vn != vn || a->epoch != cse_epoch) continue;
+
+    CseMark *saved = find_mark(a->node, false);
+    int reg;
+    if (saved) {
+      // its register has been given to another value since
+      reg = saved->reg;
+      if (reg_owner[reg] != a->node) return false;
+    } else {
+      for (reg = 0; reg < NUM_CSE_REGS; reg++)
+        if (!reg_pinned[reg] && reg_busy[reg] < a->pos) break;
+      if (reg == NUM_CSE_REGS) return false;
+      saved = find_mark(a->node, true);
+      *saved = (CseMark){a->node, reg, true};
+      reg_owner[reg] = a->node;
+      reg_start[reg] = a->pos;
+    }
+
+    reg_busy[reg] = cse_pos;
+    if (cse_loop_depth && a->pos <= cse_loop_start) reg_pinned[reg] = true;
+    *find_mark(node, true) = (CseMark){node, reg, false};
+    return true;
+  }
+  return false;
+}
+
+static long number(Node *node);
+
+// Numbers the index i * size of pointer arithmetic. It is not reused, so
+// that it can be folded into loads and stores, see fold_address().
+static long number_scale(Node *node) {
+  long lhs = number(node->lhs);
+  long rhs = number(node->rhs);
+  cse_pos++;
+  return lhs < 0 || rhs < 0 ? -1 : value_number(NK_MUL, lhs, rhs);
+}
+
+// Numbers the binary chain `node` like gen_binary() generates it.
+static long number_binary(Node *node) {
+  int base = chain_len;
+  for (Node *n = node; is_binary(n); n = n->lhs) push_chain(n);
+
+  // what the operand chain computed, should one of its operators reuse a
+  // value
+  int start = num_avail;
+  long vn = number(chain_ops[chain_len - 1]->lhs);
+
+  while (chain_len > base) {
+    Node *n = chain_ops[--chain_len];
+    long rhs = is_scaled(n) ? number_scale(n->rhs) : number(n->rhs);
+    vn = vn < 0 || rhs < 0 ? -1 : value_number(n->kind, vn, rhs);
+    cse_pos++;
+    if (vn < 0) continue;
+    if (reuse(n, vn)) num_avail = start;
+    else add_avail(vn, n);
+  }
+  return vn;
+}
+
+// Numbers `node` and the nodes within it. Returns its value number, or -1
+// if it has effects or reads memory.
+static long number(Node *node) {
+  switch (node->kind) {
+  case NK_NUM:
+    return value_number(NK_NUM, node->val, 0);
+  case NK_SIZEOF:
+    return value_number(NK_NUM, node->lhs->type->size, 0);
+  case NK_VAR:
+    if (node->var->type->kind == TYK_ARRAY)
+      return value_number(NK_ADDR, (intptr_t)node->var, 0);
+    return value_number(NK_VAR, (intptr_t)node->var, node->var->version);
+  case NK_NEG:
+  case NK_NOT: {
+    long vn = number(node->lhs);
+    return vn < 0 ? -1 : value_number(node->kind, vn, 0);
+  }
+  case NK_LOGAND:
+  case NK_LOGOR: {
+    // the rhs may not run
+    number(node->lhs);
+    int len = num_avail;
+    number(node->rhs);
+    num_avail = len;
+    return -1;
+  }
+  case NK_DEREF: {
+    // an array is not loaded; its elements are
+    long vn = number(node->lhs);
+    return node->type->kind == TYK_ARRAY ? vn : -1;
+  }
+  case NK_ADDR:
+    return node->lhs->kind == NK_DEREF ? number(node->lhs->lhs) : -1;
+  case NK_ASSIGN:
+  case NK_ADD_ASSIGN:
+  case NK_SUB_ASSIGN:
+  case NK_MUL_ASSIGN:
+  case NK_DIV_ASSIGN:
+  case NK_POST_INC:
+  case NK_POST_DEC:
+    number(node->rhs);
+    if (node->lhs->kind == NK_DEREF) number(node->lhs->lhs);
+    else node->lhs->var->version++;
+    return -1;
+  case NK_FUNC_CALL:
+    for (Node *arg = node->args; arg; arg = arg->next) number(arg);
+    cse_epoch++;
+    return -1;
+  default:
+    return is_binary(node) ? number_binary(node) : -1;
+  }
+}
+
+static bool invalidate(Node *node, void *arg) {
+  if (is_assignment(node) && node->lhs->kind == NK_VAR)
+    node->lhs->var->version++;
+  if (node->kind == NK_FUNC_CALL) cse_epoch++;
+  return false;
+}
+
+static void number_stmt(Node *node) {
+  int len = num_avail;
+
+  switch (node->kind) {
+  case NK_EXPR_STMT:
+  case NK_RETURN_STMT:
+    number(node->lhs);
+    return;
+  case NK_COMPOUND_STMT:
+    for (Node *stmt = node->body; stmt; stmt = stmt->next)
+      number_stmt(stmt);
+    return;
+  case NK_IF_STMT:
+    number(node->cond);
+    len = num_avail;
+    number_stmt(node->lhs);
+    num_avail = len;
+    if (node->rhs) number_stmt(node->rhs);
+    num_avail = len;
+    return;
+  case NK_WHILE_STMT:
+  case NK_FOR_STMT: {
+    if (node->lhs) number(node->lhs);
+    visit(node, invalidate, NULL);
+    int outer_start = cse_loop_start;
+    cse_loop_start = cse_pos;
+    cse_loop_depth++;
+    len = num_avail;
+    if (node->cond) number(node->cond);
+    num_avail = len;
+    number_stmt(node->body);
+    if (node->rhs) number(node->rhs);
+    num_avail = len;
+
+    // values from before the loop used in it are used on every iteration
+    for (int reg = 0; reg < NUM_CSE_REGS; reg++)
+      if (reg_owner[reg] && reg_start[reg] <= cse_loop_start &&
+          reg_busy[reg] >= cse_loop_start)
+        reg_busy[reg] = cse_pos;
+    cse_loop_start = outer_start;
+    if (--cse_loop_depth == 0) {
+      for (int reg = 0; reg < NUM_CSE_REGS; reg++) {
+        if (reg_pinned[reg]) reg_busy[reg] = cse_pos;
+        reg_pinned[reg] = false;
+      }
+    }
+    return;
+  }
+  case NK_SWITCH_STMT:
+    number(node->cond);
+    len = num_avail;
+    number_stmt(node->body);
+    num_avail = len;
+    return;
+  case NK_CASE_STMT:
+  case NK_DEFAULT_STMT:
+    // nothing computed before a label is known to be computed when it is
+    // jumped to
+    cse_epoch++;
+    number_stmt(node->lhs);
+    return;
+  default:
+    return;
+  }
+}
+
+// Marks the operators of `fun` that can reuse the value of an earlier one.
+static void number_function(Fun *fun) {
+  marks = NULL;
+  marks_cap = num_marks = 0;
+  eliminated = 0;
+  if (addresses_taken) return;
+
+  values = NULL;
+  values_cap = num_values = 0;
+  avail = NULL;
+  avail_cap = num_avail = 0;
+  cse_pos = cse_epoch = 0;
+  cse_loop_depth = 0;
+  for (int reg = 0; reg < NUM_CSE_REGS; reg++) {
+    reg_owner[reg] = NULL;
+    reg_busy[reg] = -1;
+    reg_pinned[reg] = false;
+  }
+  number_stmt(fun->body);
+}
+
+// Lays out the frame: the registers saved by the prologue on top, then the
+// locals that live in memory.
+static void assign_lvar_offsets(Fun *fun, int num_regs) {
+  int offset = 8 * num_regs;
+  for (Obj *var = fun->locals; var; var = var->next) {
+    if (var->reg) continue;
+    offset += var->type->size;
+    var->offset = -offset;
+  }
+  fun->stack_size = align_to(offset, 16);
+}
+
+static void gen_func(Fun *fun) {
+  current_function = fun;
+  addresses_taken = false;
+  for (Obj *var = fun->locals; var; var = var->next)
+    addresses_taken |= var->address_taken;
+  depth = 0;
+  temp_depth = 0;
+  label_count = 0;
+  break_label = 0;
+  current_switch = NULL;
+  chain_ops = NULL;
+  chain_len = chain_cap = 0;
+  sites = NULL;
+  num_sites = sites_cap = 0;
+
+  int num_regs = promote_locals(fun);
+  assign_lvar_offsets(fun, num_regs);
+  number_function(fun);
+  annotate(fun->body);
+
+  emit(".global _%s\n\n", fun->name);
+  emit("_%s:\n", fun->name);
+
+  // prologue
+  emit("    stp fp, lr, [sp, #-16]!\n");
+  emit("    mov fp, sp\n");
+  emit("    sub sp, sp, #%d\n", fun->stack_size);
+  for (int i = 0; i < num_regs; i++)
+    emit("    str x%d, [fp, #%d]\n", FIRST_SAVED_REG + i, -8 * (i + 1));
+  if (opt->instrument) gen_count_call();
+
+  // move params in registers into their allocated space in the stack, or
+  // the register they are promoted to
+  int i = 0;
+  for (Obj *var = fun->params; var; var = var->next) {
+    if (var->reg) gen_store_var(argreg[i++], var);
+    else emit("    str %s, [fp, %d] \n", argreg[i++], var->offset);
+  }
+
+  gen_stmt(fun->body);
+
+  // epilogue
+  emit_label(RETURN_LABEL);
+  for (int i = 0; i < num_regs; i++)
+    emit("    ldr x%d, [fp, #%d]\n", FIRST_SAVED_REG + i, -8 * (i + 1));
+  emit("    mov sp, fp\n");
+  emit("    ldp fp, lr, [sp], #16\n");
+  emit("    ret\n\n");
+
+  if (cold_out) {
+    fclose(cold_out);
+    cold_out = NULL;
+    fwrite(cold_buf, 1, cold_len, out);
+    free(cold_buf);
+    emit("\n");
+  }
+
+  if (opt->instrument) gen_profile_data(fun);
+}
+
+// Functions waiting to be generated. Workers claim them in order through
+// `next`, and each function is generated into its own buffer. A function
+// that fails leaves its diagnostic in `errors` instead.
+typedef struct {
+  Fun **funs;
+  char **bufs;
+  size_t *lens;
+  char **errors;
+  // -fvectorize-report remarks
+  char **remarks;
+  size_t *remarks_lens;
+  // instructions saved by reusing values
+  atomic_long cse_eliminated;
+  int nfuns;
+  atomic_int next;
+
+  // the context of the thread that called codegen()
+  char *input;
+  Options *opt;
+  Arena *arena;
+} Work;
+
+// A code generation thread besides the caller of codegen(). It allocates
+// from an arena of its own, which is handed over to the caller's arena once
+// all threads are done.
+typedef struct {
+  Work *work;
+  Arena arena;
+  pthread_t thread;
+} Worker;
+
+static void gen_one(Work *work, int i) {
+  FILE *fp = open_memstream(&work->bufs[i], &work->lens[i]);
+  out = fp;
+  if (opt->vectorize_report)
+    remarks_out = open_memstream(&work->remarks[i], &work->remarks_lens[i]);
+
+  jmp_buf jmp;
+  error_jmp = &jmp;
+
+  if (setjmp(jmp)) {
+    fclose(fp);
+    if (cold_out) {
+      fclose(cold_out);
+      cold_out = NULL;
+      free(cold_buf);
+    }
+    in_cold = false;
+    if (remarks_out) fclose(remarks_out);
+    remarks_out = NULL;
+    free(work->bufs[i]);
+    work->bufs[i] = NULL;
+    work->errors[i] = error_message;
+    return;
+  }
+
+  gen_func(work->funs[i]);
+  atomic_fetch_add(&work->cse_eliminated, eliminated);
+  fclose(fp);
+  simplify_cfg(&work->bufs[i], &work->lens[i]);
+  if (opt->tune) schedule(&work->bufs[i], &work->lens[i]);
+  if (remarks_out) fclose(remarks_out);
+  remarks_out = NULL;
+}
+
+// Generates functions until there are none left.
+static void run(Work *work) {
+  jmp_buf *saved_jmp = error_jmp;
+  for (;;) {
+    int i = atomic_fetch_add(&work->next, 1);
+    if (i >= work->nfuns) break;
+    gen_one(work, i);
+  }
+  error_jmp = saved_jmp;
+}
+
+static void *worker(void *arg) {
+  Worker *w = arg;
+  if (w->work->arena) current_arena = &w->arena;
+  current_input = w->work->input;
+  opt = w->work->opt;
+  run(w->work);
+  return NULL;
+}
+
+// Generates code for every function of `prog` that does not have its code
+// yet, on up to `opt->jobs` threads. If several functions fail, the error
+// of the first one in source order is reported, whatever the number of
+// threads.
+void codegen(Fun *prog) {
+  Work work = {0};
+  for (Fun *fun = prog; fun; fun = fun->next)
+    if (!fun->output) work.nfuns++;
+
+  work.funs = allocate(work.nfuns * sizeof(Fun *));
+  work.bufs = allocate(work.nfuns * sizeof(char *));
+  work.lens = allocate(work.nfuns * sizeof(size_t));
+  work.errors = allocate(work.nfuns * sizeof(char *));
+  work.remarks = allocate(work.nfuns * sizeof(char *));
+  work.remarks_lens = allocate(work.nfuns * sizeof(size_t));
+  int i = 0;
+  for (Fun *fun = prog; fun; fun = fun->next)
+    if (!fun->output) work.funs[i++] = fun;
+
+  work.input = current_input;
+  work.opt = opt;
+  work.arena = current_arena;
+
+  int jobs = opt->jobs;
+  if (jobs > work.nfuns) jobs = work.nfuns;
+  if (jobs < 1) jobs = 1;
+
+  // the calling thread is one of the workers, and allocates from the
+  // current arena directly; with a single job, no memory blocks are added
+  Worker *workers = allocate(jobs * sizeof(Worker));
+  int nthreads = 1;
+  for (; nthreads < jobs; nthreads++) {
+    workers[nthreads].work = &work;
+    if (pthread_create(&workers[nthreads].thread, NULL, worker,
+                       &workers[nthreads]))
+      break;
+  }
+  run(&work);
+  for (i = 1; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (work.arena) arena_merge(work.arena, &workers[i].arena);
+  }
+
+  char *msg = NULL;
+  for (i = 0; i < work.nfuns; i++) {
+    if (!msg && work.errors[i]) msg = work.errors[i];
+    else free(work.errors[i]);
+
+    if (!msg) {
+      Fun *fun = work.funs[i];
+      fun->output = copy_string(work.bufs[i], work.lens[i]);
+      fun->output_len = work.lens[i];
+      if (work.remarks_lens[i])
+        fun->remarks = copy_string(work.remarks[i], work.remarks_lens[i]);
+    }
+    free(work.bufs[i]);
+    free(work.remarks[i]);
+  }
+
+  if (msg) fail(msg);
+  if (report) report->cse_eliminated += work.cse_eliminated;
 }
@@ -0,0 +1,330 @@
+#include "quackcc.h"
+
+#include <unistd.h>
+
+struct QuackCC {
+  // everything allocated while compiling, released by the next compile;
+  // its memory is reused rather than returned to the system
+  Arena arena;
+
+  char *output;
+  size_t output_len;
+  char *error;
+
+  Options opt;
+  Report report;
+  char *report_text;
+};
+
+_Thread_local Options *opt;
+
+// Where to go when the compilation fails on this thread. Without one,
+// errors are printed and the process exits.
+_Thread_local jmp_buf *error_jmp;
+_Thread_local char *error_message;
+
+// Abandons the current compilation with `msg`, a string on the heap.
+void fail(char *msg) {
+  if (error_jmp) {
+    error_message = msg;
+    longjmp(*error_jmp, 1);
+  }
+
+  fputs(msg, stderr);
+  exit(1);
+}
+
+// Reports an error.
+void error(char *fmt, ...) {
+  char *msg;
+  size_t len;
+  FILE *fp = open_memstream(&msg, &len);
+
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(fp, fmt, ap);
+  va_end(ap);
+  fprintf(fp, "\n");
+
+  fclose(fp);
+  fail(msg);
+}
+
+QuackCC *quackcc_new(void) {
+  QuackCC *cc = calloc(1, sizeof(QuackCC));
+  if (!cc) return NULL;
+  cc->opt.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  return cc;
+}
+
+static void reset(QuackCC *cc) {
+  arena_reset(&cc->arena);
+  free(cc->output);
+  free(cc->error);
+  free(cc->report_text);
+  cc->output = NULL;
+  cc->output_len = 0;
+  cc->error = NULL;
+  cc->report_text = NULL;
+}
+
+void quackcc_free(QuackCC *cc) {
+  if (!cc) return;
+  reset(cc);
+  arena_free(&cc->arena);
+  free(cc->opt.cache_dir);
+  free_profile(cc->opt.profile);
+  free(cc);
+}
+
+int quackcc_set_option(QuackCC *cc, char *option) {
+  if (strncmp(option, "-j", 2) == 0) {
+    int jobs = atoi(option + 2);
+    if (jobs < 1) return -1;
+    cc->opt.jobs = jobs;
+    return 0;
+  }
+
+  if (strncmp(option, "-fcache-dir=", 12) == 0) {
+    free(cc->opt.cache_dir);
+    cc->opt.cache_dir = strdup(option + 12);
+    return 0;
+  }
+
+  if (strcmp(option, "-fstreaming") == 0) {
+    cc->opt.streaming = true;
+    return 0;
+  }
+
+  if (strcmp(option, "-finstrument") == 0) {
+    cc->opt.instrument = true;
+    return 0;
+  }
+
+  if (strncmp(option, "-fprofile-use=", 14) == 0) {
+    Profile *profile = read_profile(option + 14);
+    if (!profile) return -1;
+    free_profile(cc->opt.profile);
+    cc->opt.profile = profile;
+    return 0;
+  }
+
+  if (strcmp(option, "-fvectorize") == 0) {
+    cc->opt.vectorize = true;
+    return 0;
+  }
+
+  if (strcmp(option, "-fvectorize-report") == 0) {
+    cc->opt.vectorize_report = true;
+    return 0;
+  }
+
+  if (strcmp(option, "-funroll-loops") == 0) {
+    cc->opt.unroll = DEFAULT_UNROLL;
+    return 0;
+  }
+
+  if (strncmp(option, "-funroll-loops=", 15) == 0) {
+    int unroll = atoi(option + 15);
+    if (unroll < 2 || unroll > MAX_UNROLL) return -1;
+    cc->opt.unroll = unroll;
+    return 0;
+  }
+
+  if (strncmp(option, "-mtune=", 7) == 0) {
+    if (strcmp(option + 7, "generic") == 0) {
+      cc->opt.tune = NULL;
+      return 0;
+    }
+    MachineModel *tune = find_machine_model(option + 7);
+    if (!tune) return -1;
+    cc->opt.tune = tune;
+    return 0;
+  }
+
+  if (strcmp(option, "-ftime-report") == 0) {
+    cc->opt.time_report = true;
+    return 0;
+  }
+
+  if (strcmp(option, "-fmem-report") == 0) {
+    cc->opt.mem_report = true;
+    return 0;
+  }
+
+  if (strcmp(option, "-freport-format=text") == 0) {
+    cc->opt.report_json = false;
+    return 0;
+  }
+
+  if (strcmp(option, "-freport-format=json") == 0) {
+    cc->opt.report_json = true;
+    return 0;
+  }
+
+  return -1;
+}
+
+// Returns a description of the options that change the generated code.
+// Cached code is only reused under the same fingerprint.
+char *options_fingerprint(void) {
+  char *buf;
+  size_t len;
+  FILE *fp = open_memstream(&buf, &len);
+  if (opt->instrument) fprintf(fp, " -finstrument");
+  if (opt->vectorize) fprintf(fp, " -fvectorize");
+  if (opt->unroll) fprintf(fp, " -funroll-loops=%d", opt->unroll);
+  if (opt->tune) fprintf(fp, " -mtune=%s", opt->tune->name);
+  if (opt->profile)
+    fprintf(fp, " -fprofile-use=%016llx",
+            (unsigned long long)opt->profile->hash);
+  fclose(fp);
+
+  char *fingerprint = copy_string(buf, len);
+  free(buf);
+  return fingerprint;
+}
+
+// -fvectorize-report remarks of the compilation running on this thread
+static _Thread_local FILE *remarks;
+
+// Writes out the code of `fun` and caches it.
+static void output(Fun *fun, FILE *out) {
+  fwrite(fun->output, 1, fun->output_len, out);
+  if (report) report->output_bytes += fun->output_len;
+  if (remarks && fun->remarks) fputs(fun->remarks, remarks);
+  if (fun->cache_key)
+    cache_store(fun->cache_key, fun->output, fun->output_len);
+}
+
+// Compiles the whole translation unit at once: tokenises all of it, parses
+// every function, and generates code for all functions in parallel.
+static void compile_all(char *input, FILE *out) {
+  phase_begin(PHASE_TOKENISE);
+  Token *token = tokenise(input);
+  phase_end();
+
+  phase_begin(PHASE_PARSE);
+  Fun *prog = parse(token);
+  phase_end();
+
+  phase_begin(PHASE_CODEGEN);
+  codegen(prog);
+  phase_end();
+
+  phase_begin(PHASE_OUTPUT);
+  for (Fun *fun = prog; fun; fun = fun->next) output(fun, out);
+  phase_end();
+}
+
+// Compiles one function definition at a time for -fstreaming: tokenises,
+// parses, types, generates and writes out a function, then releases all
+// memory allocated for it before moving on. Peak memory is then bound by
+// the largest function rather than by the whole input, at the cost of
+// generating code on a single thread.
+static void compile_streaming(char *input, FILE *out) {
+  current_input = input;
+  char *p = input;
+
+  for (;;) {
+    ArenaMark mark = arena_mark(current_arena);
+
+    phase_begin(PHASE_TOKENISE);
+    Token *token = tokenise_definition(&p);
+    phase_end();
+    if (token->kind == TK_EOF) break;
+
+    phase_begin(PHASE_PARSE);
+    Fun *fun = parse(token);
+    phase_end();
+
+    phase_begin(PHASE_CODEGEN);
+    codegen(fun);
+    phase_end();
+
+    phase_begin(PHASE_OUTPUT);
+    output(fun, out);
+    phase_end();
+
+    arena_release(current_arena, mark);
+  }
+}
+
+int quackcc_compile_file(QuackCC *cc, const char *src, size_t len,
+                         FILE *out) {
+  reset(cc);
+
+  Arena *saved_arena = current_arena;
+  jmp_buf *saved_jmp = error_jmp;
+  char *saved_input = current_input;
+  Options *saved_opt = opt;
+  Report *saved_report = report;
+
+  jmp_buf jmp;
+  current_arena = &cc->arena;
+  error_jmp = &jmp;
+  opt = &cc->opt;
+
+  bool want_report = opt->time_report || opt->mem_report;
+  memset(&cc->report, 0, sizeof(Report));
+  report = want_report ? &cc->report : NULL;
+
+  // remarks come first in the report text
+  size_t report_len;
+  FILE *report_fp = NULL;
+  if (want_report || opt->vectorize_report)
+    report_fp = open_memstream(&cc->report_text, &report_len);
+  FILE *saved_remarks = remarks;
+  remarks = opt->vectorize_report ? report_fp : NULL;
+
+  int ret = 0;
+  if (setjmp(jmp)) {
+    cc->error = error_message;
+    ret = -1;
+  } else {
+    char *input = copy_string((char *)src, len);
+    if (opt->streaming) compile_streaming(input, out);
+    else compile_all(input, out);
+  }
+
+  if (want_report)
+    print_report(report_fp, &cc->report, opt->time_report, opt->mem_report,
+                 opt->report_json);
+  if (report_fp) fclose(report_fp);
+  remarks = saved_remarks;
+
+  current_arena = saved_arena;
+  error_jmp = saved_jmp;
+  current_input = saved_input;
+  opt = saved_opt;
+  report = saved_report;
+  return ret;
+}
+
+int quackcc_compile(QuackCC *cc, const char *src, size_t len,
+                    char **out, size_t *out_len) {
+  char *buf;
+  size_t buf_len;
+  FILE *fp = open_memstream(&buf, &buf_len);
+  int ret = quackcc_compile_file(cc, src, len, fp);
+  fclose(fp);
+
+  // the output of a failed compile is incomplete
+  if (ret) free(buf);
+  else {
+    cc->output = buf;
+    cc->output_len = buf_len;
+  }
+
+  if (out) *out = cc->output;
+  if (out_len) *out_len = cc->output_len;
+  return ret;
+}
+
+const char *quackcc_error(QuackCC *cc) {
+  return cc->error;
+}
+
+const char *quackcc_report(QuackCC *cc) {
+  return cc->report_text;
+}
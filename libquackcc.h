@@ -0,0 +1,39 @@
+#ifndef LIBQUACKCC_H
+#define LIBQUACKCC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// A compiler context. Contexts are independent of each other, so different
+// threads may compile with different contexts at the same time. A single
+// context must not be used by more than one thread at a time.
+typedef struct QuackCC QuackCC;
+
+QuackCC *quackcc_new(void);
+void quackcc_free(QuackCC *cc);
+
+// Applies a command line option such as "-j4". Returns 0 on success and -1
+// if the option is not recognised or cannot be applied, such as a
+// -fprofile-use profile that cannot be read.
+int quackcc_set_option(QuackCC *cc, char *option);
+
+// Compiles `len` bytes of source code at `src`. On success, returns 0 and
+// points `*out` at the generated assembly. On failure, returns -1 and the
+// diagnostic is available from quackcc_error(). The output and the message
+// belong to the context and stay valid until its next compile.
+int quackcc_compile(QuackCC *cc, const char *src, size_t len,
+                    char **out, size_t *out_len);
+const char *quackcc_error(QuackCC *cc);
+
+// Like quackcc_compile(), but writes the assembly to `out` as it is
+// generated. With -fstreaming, this happens function by function, and a
+// failed compile leaves the code of the functions before the error in
+// `out`.
+int quackcc_compile_file(QuackCC *cc, const char *src, size_t len,
+                         FILE *out);
+
+// Returns the -fvectorize-report, -ftime-report and -fmem-report output of
+// the last compile, or NULL if no report was requested.
+const char *quackcc_report(QuackCC *cc);
+
+#endif
@@ -1,23 +1,99 @@
 #include "quackcc.h"
 
-// Reports an error and exit.
-void error(char *fmt, ...) {
-  va_list ap;
-  va_start(ap, fmt);
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+static QuackCC *cc;
+
+static char *input;
+
+static bool server_mode;
+static char *socket_path;
+
+// options applied to the compiler, kept for the contexts of the server
+static char **options;
+static int num_options;
+
+// Reads the whole of stdin.
+static char *read_stdin(void) {
+  char *buf;
+  size_t len;
+  FILE *fp = open_memstream(&buf, &len);
+
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+    fwrite(chunk, 1, n, fp);
+
+  fclose(fp);
+  return buf;
+}
+
+static void usage(char *prog) {
+  error("usage: %s [options] <program>\n"
+        "       %s [options] --server[=<socket>]", prog, prog);
+}
+
+static void add_option(char *prog, char *option) {
+  if (quackcc_set_option(cc, option))
+    error("%s: invalid argument: %s", prog, option);
+  options[num_options++] = option;
+}
+
+static void parse_args(int argc, char **argv) {
+  options = calloc(argc, sizeof(char *));
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--server") == 0) {
+      server_mode = true;
+      continue;
+    }
+
+    if (strncmp(argv[i], "--server=", 9) == 0) {
+      server_mode = true;
+      socket_path = argv[i] + 9;
+      continue;
+    }
+
+    // accept "-j N" as well as "-jN"
+    if (strcmp(argv[i], "-j") == 0) {
+      if (++i == argc) usage(argv[0]);
+      char *option = calloc(1, strlen(argv[i]) + 3);
+      sprintf(option, "-j%s", argv[i]);
+      add_option(argv[0], option);
+      continue;
+    }
+
+    if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      add_option(argv[0], argv[i]);
+      continue;
+    }
+
+    if (input || server_mode) usage(argv[0]);
+    input = argv[i];
+  }
+
+  if (server_mode ? input != NULL : input == NULL) usage(argv[0]);
 }
 
 int main(int argc, char **argv) {
-  if (argc != 2) error("%s: invalid number of arguments", argv[0]);
+  cc = quackcc_new();
+  if (!cc) error("out of memory");
+
+  parse_args(argc, argv);
+
+  if (server_mode) {
+    quackcc_free(cc);
+    return run_server(socket_path, options, num_options);
+  }
+
+  // "-" reads the program from stdin, for programs too long for argv
+  if (strcmp(input, "-") == 0) input = read_stdin();
 
-  // tokenise
-  Token *token = tokenise(argv[1]);
-  // parse
-  Fun *prog = parse(token);
-  // generate code
-  codegen(prog);
+  if (quackcc_compile_file(cc, input, strlen(input), stdout)) {
+    fputs(quackcc_error(cc), stderr);
+    if (quackcc_report(cc)) fputs(quackcc_report(cc), stderr);
+    return 1;
+  }
 
+  if (quackcc_report(cc)) fputs(quackcc_report(cc), stderr);
+  quackcc_free(cc);
   return 0;
 }
@@ -1,14 +1,27 @@
 #include "quackcc.h"
 
 // input tokens are represented by a linked list.
-static Token **chain;
+static _Thread_local Token **chain;
 
-static Obj *locals;
+static _Thread_local Obj *locals;
+
+// the innermost switch statement being parsed, whether it has a default
+// label yet, and how many loops and switches around the statement being
+// parsed a break may leave
+static _Thread_local Node *current_switch;
+static _Thread_local bool has_default;
+static _Thread_local int breakable;
+
+// Code generation recurses once per level an expression nests through
+// brackets and prefix operators, so that is limited. `nesting` is the
+// level of the expression being parsed.
+#define MAX_NESTING 4096
+static _Thread_local int nesting;
 
 static char *get_ident(Token *token) {
   if (token->kind != TK_IDENT)
     error_at(token->loc, "expected an identifier");
-  return strndup(token->loc, token->len);
+  return copy_string(token->loc, token->len);
 }
 
 static int get_number(Token *token) {
@@ -17,8 +30,32 @@ static int get_number(Token *token) {
   return token->val;
 }
 
+// Returns the number of bytes of Node used by nodes of `kind`.
+static size_t node_size(NodeKind kind) {
+  switch (kind) {
+  case NK_NUM:
+  case NK_NULL_STMT:
+  case NK_BREAK_STMT:
+    return offsetof(Node, var);
+  case NK_VAR:
+    return offsetof(Node, var) + sizeof(Obj *);
+  case NK_FUNC_CALL:
+    return offsetof(Node, args) + sizeof(Node *);
+  case NK_COMPOUND_STMT:
+    return offsetof(Node, body) + sizeof(Node *);
+  case NK_IF_STMT:
+  case NK_WHILE_STMT:
+  case NK_FOR_STMT:
+  case NK_SWITCH_STMT:
+    return sizeof(Node);
+  default:
+    return offsetof(Node, body);
+  }
+}
+
 static Node *create_node(NodeKind kind, Token *token) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = allocate(node_size(kind));
+  if (report) report->nodes++;
   node->kind = kind;
   node->token = token;
   return node;
@@ -108,6 +145,33 @@ static Node *create_sub(Node *lhs, Node *rhs, Token *token) {
   return create_binary(NK_DIV, node, create_num(base_size, token), token);
 };
 
+// Compound assignments scale the rhs of `+=` and `-=` like `+` and `-` when
+// the lhs is a pointer.
+static Node *create_assign_op(NodeKind kind, Node *lhs, Node *rhs,
+                              Token *token) {
+  add_type(lhs);
+  add_type(rhs);
+
+  bool is_lhs_integer = is_integer(lhs->type);
+  if (!is_integer(rhs->type) ||
+      (!is_lhs_integer && kind != NK_ADD_ASSIGN && kind != NK_SUB_ASSIGN))
+    error_at(token->loc, "invalid operands");
+
+  if (!is_lhs_integer) {
+    int base_size = lhs->type->base->size;
+    rhs = create_binary(NK_MUL, rhs, create_num(base_size, token), token);
+  }
+  return create_binary(kind, lhs, rhs, token);
+}
+
+// Increments and decrements step a pointer by the size of what it points
+// to.
+static Node *create_step(NodeKind kind, Node *lhs, Token *token) {
+  add_type(lhs);
+  int step = is_integer(lhs->type) ? 1 : lhs->type->base->size;
+  return create_binary(kind, lhs, create_num(step, token), token);
+}
+
 static Node *create_var(Obj *var, Token *token) {
   Node *node = create_node(NK_VAR, token);
   node->var = var;
@@ -115,7 +179,8 @@ static Node *create_var(Obj *var, Token *token) {
 }
 
 static Obj *create_local(char *name, Type *type) {
-  Obj *obj = calloc(1, sizeof(Obj));
+  Obj *obj = allocate(sizeof(Obj));
+  if (report) report->objects++;
   obj->name = name;
   obj->type = type;
   obj->next = locals;
@@ -123,10 +188,10 @@ static Obj *create_local(char *name, Type *type) {
   return obj;
 }
 
-static void create_param_locals(Type *param_type) {
-  if (!param_type) return;
-  create_param_locals(param_type->next_param_type);
-  create_local(get_ident(param_type->ident), param_type);
+static void create_param_locals(Param *param) {
+  if (!param) return;
+  create_param_locals(param->next);
+  create_local(get_ident(param->ident), param->type);
 }
 
 static Obj *find_var(char *name) {
@@ -152,29 +217,27 @@ static Fun *function_def(void);
 static Node *stmt(void);
 static Node *declaration(void);
 static Node *declaration_prime(Type *base);
-static Type *declarator(Type *type);
-static Type *declarator_prefix(Type *type);
-static Type *func_params(Type *type);
+static Type *declarator(Type *type, Token **ident);
+static Type *declarator_prefix(Type *type, Token **ident);
+static Type *func_params(Type *return_type);
 static Type *array_dimension(Type *type);
 static Type *declarator_suffix(Type *type);
 static Type *decl_spec(void);
 static Node *if_stmt(void);
 static Node *while_stmt(void);
 static Node *for_stmt(void);
+static Node *switch_stmt(void);
+static Node *case_stmt(void);
+static Node *default_stmt(void);
+static Node *break_stmt(void);
 static Node *compound_stmt(void);
 static Node *null_stmt(void);
 static Node *return_stmt(void);
 static Node *expr_stmt(void);
 static Node *expr(void);
+static int const_expr(void);
 static Node *assign(void);
-static Node *equality(void);
-static Node *equality_prime(Node *lhs);
-static Node *relational(void);
-static Node *relational_prime(Node *lhs);
-static Node *sum(void);
-static Node *sum_prime(Node *lhs);
-static Node *term(void);
-static Node *term_prime(Node *lhs);
+static Node *binary(void);
 static Node *unary(void);
 static Node *postfix(void);
 static Node *factor(void);
@@ -187,7 +250,9 @@ static bool can_start_stmt() {
 
   if (head->kind == TK_KEYWORD) {
     if (equal(head, "return") || equal(head, "if") || equal(head, "for") ||
-        equal(head, "while") || equal(head, "sizeof"))
+        equal(head, "while") || equal(head, "sizeof") ||
+        equal(head, "switch") || equal(head, "case") ||
+        equal(head, "default") || equal(head, "break"))
       return true;
   }
 
@@ -196,19 +261,61 @@ static bool can_start_stmt() {
     if (equal(head, "{") || equal(head, ";")) return true;
     // can start expr stmt
     if (equal(head, "(") || equal(head, "+") || equal(head, "-") ||
-        equal(head, "*") || equal(head, "&")) return true;
+        equal(head, "!") || equal(head, "*") || equal(head, "&") ||
+        equal(head, "++") || equal(head, "--"))
+      return true;
   }
 
   return false;
 }
 
+// Looks up the function definition at the head of the chain in the cache.
+// On a hit, skips the definition and returns it with its code. On a miss,
+// returns NULL and leaves the key for the definition in `*key`.
+static Fun *cached_function_def(char **key) {
+  Token *start = *chain;
+  Token *end = skip_function(start);
+  if (!end) return NULL;
+
+  *key = cache_key(start, end);
+
+  size_t len;
+  char *output = cache_lookup(*key, &len);
+  if (!output) {
+    if (report) report->cache_misses++;
+    return NULL;
+  }
+  if (report) report->cache_hits++;
+
+  // DeclSpec "*"* Ident
+  Token *ident = start->next;
+  while (equal(ident, "*")) ident = ident->next;
+
+  Fun *fun = allocate(sizeof(Fun));
+  fun->name = get_ident(ident);
+  fun->token = ident;
+  fun->output = output;
+  fun->output_len = len;
+  *chain = end;
+  return fun;
+}
+
 // Program -> FunctionDefinition* EOF
 static Fun *program() {
   Fun temp = {};
   Fun *curr = &temp;
 
   while ((*chain)->kind != TK_EOF) {
-    curr->next = function_def();
+    char *key = NULL;
+    Fun *fun = NULL;
+    if (opt->cache_dir) fun = cached_function_def(&key);
+
+    if (!fun) {
+      fun = function_def();
+      fun->cache_key = key;
+    }
+
+    curr->next = fun;
     curr = curr->next;
   }
 
@@ -216,6 +323,7 @@ static Fun *program() {
 }
 
 // Stmt -> ExprStmt | CompoundStmt | NullStmt | ReturnStmt | IfStmt | ForStmt
+//       | WhileStmt | SwitchStmt | CaseStmt | DefaultStmt | BreakStmt
 static Node *stmt() {
   Token *head = *chain;
 
@@ -224,6 +332,10 @@ static Node *stmt() {
     if (equal(head, "if")) return if_stmt();
     if (equal(head, "for")) return for_stmt();
     if (equal(head, "while")) return while_stmt();
+    if (equal(head, "switch")) return switch_stmt();
+    if (equal(head, "case")) return case_stmt();
+    if (equal(head, "default")) return default_stmt();
+    if (equal(head, "break")) return break_stmt();
   }
   if (head->kind == TK_PUNC) {
     if (equal(head, "{")) return compound_stmt();
@@ -260,9 +372,10 @@ static Node *declaration() {
 
 // Declaration' -> Declarator ("=" Expr)?
 static Node *declaration_prime(Type *base) {
-  Type *type = declarator(base);
-  Obj *var = create_local(get_ident(type->ident), type);
-  Node *node_a = create_var(var, type->ident);
+  Token *ident;
+  Type *type = declarator(base, &ident);
+  Obj *var = create_local(get_ident(ident), type);
+  Node *node_a = create_var(var, ident);
 
   if (!equal(*chain, "="))
     return NULL;
@@ -273,15 +386,15 @@ static Node *declaration_prime(Type *base) {
 }
 
 // Declarator -> DeclaratorPrefix DeclaratorSuffix?
-static Type *declarator(Type *type) {
-  type = declarator_prefix(type);
+static Type *declarator(Type *type, Token **ident) {
+  type = declarator_prefix(type, ident);
 
   if (!equal(*chain, "(") && !equal(*chain, "[")) return type;
   return declarator_suffix(type);
 }
 
 // DeclaratorPrefix ->  "*"* Ident
-static Type *declarator_prefix(Type *type) {
+static Type *declarator_prefix(Type *type, Token **ident) {
   while (equal(*chain, "*")) {
     type = create_pointer_to(type);
     skip();
@@ -290,8 +403,7 @@ static Type *declarator_prefix(Type *type) {
   Token *head = *chain;
   if (head->kind != TK_IDENT) error_at(head->loc, "expected a variable name");
 
-  if (type == type_int) type = copy_type(type);
-  type->ident = head;
+  *ident = head;
   skip();
 
   return type;
@@ -299,47 +411,28 @@ static Type *declarator_prefix(Type *type) {
 
 // FuncParams ->
 // "(" ((DeclSpec DeclaratorPrefix) ("," DeclSpec DeclaratorPrefix)* )? ")"
-static Type *func_params(Type *type) {
-  Token *ident = type->ident;
-  type->ident = NULL;
-
+static Type *func_params(Type *return_type) {
   consume("(");
 
-  // no parameters
-  if (equal(*chain, ")")) {
-    // TODO: void?
-    consume(")");
-    type = create_function_type(type);
-    type->ident = ident;
-    return type;
-  }
-
-  Type temp = {};
-  Type *curr = &temp;
+  // TODO: void?
+  Param temp = {0};
+  Param *curr = &temp;
   int i = 0;
 
   while (!equal(*chain, ")")) {
     if (i++) consume(",");
-    Type *type = decl_spec();
-    type = declarator_prefix(type);
-    curr->next_param_type = type;
-    curr = curr->next_param_type;
+    Param *param = allocate(sizeof(Param));
+    param->type = declarator_prefix(decl_spec(), &param->ident);
+    curr->next = param;
+    curr = curr->next;
   }
 
   consume(")");
-
-  type = create_function_type(type);
-  type->ident = ident;
-  type->param_types = temp.next_param_type;
-
-  return type;
+  return create_function_type(return_type, temp.next);
 }
 
 // ArrayDimension -> ("[" num "]")*
 static Type *array_dimension(Type *type) {
-  Token *ident = type->ident;
-  type->ident = NULL;
-
   int dimensions[16];
   int stack_top = -1;
 
@@ -355,8 +448,6 @@ static Type *array_dimension(Type *type) {
 
   for (; stack_top >= 0; stack_top--)
     type = create_array_of(type, dimensions[stack_top]);
-
-  type->ident = ident;
   return type;
 }
 
@@ -399,7 +490,9 @@ static Node *while_stmt() {
   consume("(");
   node->cond = expr();
   consume(")");
+  breakable++;
   node->body = stmt();
+  breakable--;
   return node;
 }
 
@@ -416,7 +509,9 @@ static Node *for_stmt() {
   consume(";");
   if (!equal((*chain), ")")) update_node = expr();
   consume(")");
+  breakable++;
   Node *body_node = stmt();
+  breakable--;
 
   Node *for_node = create_node(NK_FOR_STMT, for_token);
   for_node->lhs = init_node;
@@ -427,6 +522,61 @@ static Node *for_stmt() {
   return for_node;
 }
 
+// SwitchStmt -> 'switch' '(' Expr ')' Stmt
+static Node *switch_stmt() {
+  Token *switch_token = consume("switch");
+  Node *node = create_node(NK_SWITCH_STMT, switch_token);
+  consume("(");
+  node->cond = expr();
+  consume(")");
+
+  Node *outer = current_switch;
+  bool outer_has_default = has_default;
+  current_switch = node;
+  has_default = false;
+  breakable++;
+  node->body = stmt();
+  breakable--;
+  current_switch = outer;
+  has_default = outer_has_default;
+  return node;
+}
+
+// CaseStmt -> 'case' ConstExpr ':' Stmt
+static Node *case_stmt() {
+  Token *case_token = consume("case");
+  if (!current_switch)
+    error_at(case_token->loc, "case label not within a switch statement");
+  Node *node = create_node(NK_CASE_STMT, case_token);
+  node->val = const_expr();
+  consume(":");
+  node->lhs = stmt();
+  return node;
+}
+
+// DefaultStmt -> 'default' ':' Stmt
+static Node *default_stmt() {
+  Token *default_token = consume("default");
+  if (!current_switch)
+    error_at(default_token->loc, "default label not within a switch statement");
+  if (has_default)
+    error_at(default_token->loc, "multiple default labels in one switch");
+  has_default = true;
+  Node *node = create_node(NK_DEFAULT_STMT, default_token);
+  consume(":");
+  node->lhs = stmt();
+  return node;
+}
+
+// BreakStmt -> 'break' ';'
+static Node *break_stmt() {
+  Token *break_token = consume("break");
+  if (!breakable)
+    error_at(break_token->loc, "break statement not within a loop or switch");
+  consume(";");
+  return create_node(NK_BREAK_STMT, break_token);
+}
+
 // CompoundStmt -> '{' (Stmt | Declaration)* '}'
 static Node *compound_stmt() {
   Token *lbrace_token = consume("{");
@@ -441,7 +591,9 @@ static Node *compound_stmt() {
       curr->next = declaration();
       curr = curr->next;
     }
+    phase_begin(PHASE_TYPE);
     add_type(curr);
+    phase_end();
   }
   Node *node = create_node(NK_COMPOUND_STMT, lbrace_token);
   node->body = temp.next;
@@ -476,158 +628,243 @@ static Node *expr() {
   return assign();
 }
 
-// Assign -> Equality ('=' Assign)?
-static Node *assign() {
-  Node *node_a = equality();
-  Token *head = *chain;
-  if (!equal(head, "=")) return node_a;
-  Token *equal_token = consume("=");
-  Node *node_b = assign();
-  return create_binary(NK_ASSIGN, node_a, node_b, equal_token);
+// Returns the value of constant expression `node`.
+static long eval(Node *node) {
+  switch (node->kind) {
+  case NK_NUM:
+    return node->val;
+  case NK_SIZEOF:
+    add_type(node->lhs);
+    return node->lhs->type->size;
+  case NK_NEG:
+    return -eval(node->lhs);
+  case NK_ADD:
+    return eval(node->lhs) + eval(node->rhs);
+  case NK_SUB:
+    return eval(node->lhs) - eval(node->rhs);
+  case NK_MUL:
+    return eval(node->lhs) * eval(node->rhs);
+  case NK_DIV: {
+    long rhs = eval(node->rhs);
+    if (rhs == 0) error_at(node->token->loc, "division by zero");
+    return eval(node->lhs) / rhs;
+  }
+  case NK_EQ:
+    return eval(node->lhs) == eval(node->rhs);
+  case NK_NE:
+    return eval(node->lhs) != eval(node->rhs);
+  case NK_LT:
+    return eval(node->lhs) < eval(node->rhs);
+  case NK_LE:
+    return eval(node->lhs) <= eval(node->rhs);
+  case NK_GT:
+    return eval(node->lhs) > eval(node->rhs);
+  case NK_GE:
+    return eval(node->lhs) >= eval(node->rhs);
+  case NK_LOGAND:
+    return eval(node->lhs) && eval(node->rhs);
+  case NK_LOGOR:
+    return eval(node->lhs) || eval(node->rhs);
+  case NK_NOT:
+    return !eval(node->lhs);
+  default:
+    error_at(node->token->loc, "expected a constant expression");
+    return 0;
+  }
 }
 
-// Equality -> Relational Equality'
-static Node *equality() {
-  Node *node_a = relational();
-  Node *node_b = equality_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
+// ConstExpr -> Binary
+static int const_expr() {
+  return eval(binary());
 }
 
-// Equality' -> "==" Relational Equality' | "!=" Relational Equality' | ε
-static Node *equality_prime(Node *lhs) {
-  Token *head = *chain;
-
-  if (!equal(head, "==") && !equal(head, "!=")) return NULL;
-
-  NodeKind kind = equal(head, "==") ? NK_EQ : NK_NE;
-  skip();
-
-  Node *node_a = create_binary(kind, lhs, relational(), head);
-  Node *node_b = equality_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
+static bool find_assign_op(Token *token, NodeKind *kind) {
+  if (token->kind != TK_PUNC) return false;
+  if (equal(token, "+=")) *kind = NK_ADD_ASSIGN;
+  else if (equal(token, "-=")) *kind = NK_SUB_ASSIGN;
+  else if (equal(token, "*=")) *kind = NK_MUL_ASSIGN;
+  else if (equal(token, "/=")) *kind = NK_DIV_ASSIGN;
+  else return false;
+  return true;
 }
 
-// Relational -> Sum Relational'
-static Node *relational() {
-  Node *node_a = sum();
-  Node *node_b = relational_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
-}
+// Assign -> Binary ('=' Binary)* (ASSIGNOP Assign)?
+//
+// Assignment is right associative. Each assignment is linked in as the rhs
+// of the previous one, so that long chains do not recurse. Chains of
+// compound assignments are rare, and recurse.
+static Node *assign() {
+  Node *node = binary();
+  Node *root = NULL;
+  Node *last = NULL;
+
+  while (equal(*chain, "=")) {
+    Token *equal_token = consume("=");
+    Node *assign_node = create_binary(NK_ASSIGN, node, NULL, equal_token);
+    if (last) last->rhs = assign_node;
+    else root = assign_node;
+    last = assign_node;
+    node = binary();
+  }
 
-// Relational' -> RELOP Sum Relational' | ε
-static Node *relational_prime(Node *lhs) {
-  Token *head = *chain;
   NodeKind kind;
+  if (find_assign_op(*chain, &kind)) {
+    Token *op_token = *chain;
+    skip();
+    node = create_assign_op(kind, node, assign(), op_token);
+  }
 
-  if (equal(head, "<")) kind = NK_LT;
-  else if (equal(head, ">")) kind = NK_GT;
-  else if (equal(head, "<=")) kind = NK_LE;
-  else if (equal(head, ">=")) kind = NK_GE;
-  else return NULL;
-
-  skip();
-
-  Node *node_a = create_binary(kind, lhs, sum(), head);
-  Node *node_b = relational_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
-}
-
-// Sum -> Term Sum'
-static Node *sum() {
-  Node *node_a = term();
-  Node *node_b = sum_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
+  if (!last) return node;
+  last->rhs = node;
+  return root;
 }
 
-// Sum' -> '+' Term Sum' | '-' Term Sum' | ε
-static Node *sum_prime(Node* lhs) {
-  Token *head = *chain;
-
-  if (!equal(head, "+") && !equal(head, "-")) return NULL;
-
-  Node *node_a = NULL;
-  skip();
-  if (equal(head, "+")) node_a = create_add(lhs, term(), head);
-  else node_a = create_sub(lhs, term(), head);
-
-  Node *node_b = sum_prime(node_a);
+// Binary operators. Operators with a higher precedence bind tighter, and
+// all of them are left associative.
+typedef struct {
+  char *punct;
+  NodeKind kind;
+  int prec;
+} BinaryOp;
+
+#define MAX_PREC 6
+
+static BinaryOp binary_ops[] = {
+  {"||", NK_LOGOR, 1},
+  {"&&", NK_LOGAND, 2},
+  {"==", NK_EQ, 3}, {"!=", NK_NE, 3},
+  {"<", NK_LT, 4}, {"<=", NK_LE, 4}, {">", NK_GT, 4}, {">=", NK_GE, 4},
+  {"+", NK_ADD, 5}, {"-", NK_SUB, 5},
+  {"*", NK_MUL, 6}, {"/", NK_DIV, 6},
+};
 
-  if (node_b == NULL) return node_a;
-  return node_b;
+static BinaryOp *find_binary_op(Token *token) {
+  if (token->kind != TK_PUNC) return NULL;
+  int len = sizeof(binary_ops) / sizeof(BinaryOp);
+  for (int i = 0; i < len; i++)
+    if (equal(token, binary_ops[i].punct)) return &binary_ops[i];
+  return NULL;
 }
 
-// Term -> Unary Term'
-static Node *term() {
-  Node *node_a = unary();
-  Node *node_b = term_prime(node_a);
-
-  if (node_b == NULL) return node_a;
-  return node_b;
+static Node *create_binary_op(BinaryOp *op, Node *lhs, Node *rhs,
+                              Token *token) {
+  if (op->kind == NK_ADD) return create_add(lhs, rhs, token);
+  if (op->kind == NK_SUB) return create_sub(lhs, rhs, token);
+  return create_binary(op->kind, lhs, rhs, token);
 }
 
-// Term' -> '*' Unary Term' | '/' Unary Term' | ε
-static Node *term_prime(Node *lhs) {
-  Token *head = *chain;
-
-  if (!equal(head, "*") && !equal(head, "/")) return NULL;
+// Binary -> Unary (BINOP Unary)*
+//
+// Parsed by operator precedence with explicit stacks rather than one
+// recursive function per precedence level. Operators on the stack have
+// strictly increasing precedence, so the stacks never hold more than
+// MAX_PREC operators however long the expression is.
+static Node *binary() {
+  Node *operands[MAX_PREC + 1];
+  BinaryOp *ops[MAX_PREC];
+  Token *tokens[MAX_PREC];
+  int top = 0;
 
-  NodeKind kind = equal(head, "*") ? NK_MUL : NK_DIV;
-  skip();
+  operands[0] = unary();
 
-  Node *node_a = create_binary(kind, lhs, unary(), head);
-  Node *node_b = term_prime(node_a);
+  for (;;) {
+    BinaryOp *op = find_binary_op(*chain);
 
-  if (node_b == NULL) return node_a;
-  return node_b;
-}
+    // apply the operators that bind at least as tight as the next one
+    while (top > 0 && (!op || ops[top - 1]->prec >= op->prec)) {
+      top--;
+      operands[top] = create_binary_op(ops[top], operands[top],
+                                       operands[top + 1], tokens[top]);
+    }
 
-// Unary -> '+' Unary | '-' Unary | '*' Unary | '&' Unary | Postfix
-static Node *unary() {
-  Token *head = *chain;
+    if (!op) return operands[0];
 
-  if (equal(head, "+")) {
+    ops[top] = op;
+    tokens[top] = *chain;
     skip();
-    return unary();
+    operands[++top] = unary();
   }
+}
 
-  if (equal(head, "-")) {
-    skip();
-    return create_unary(NK_NEG, unary(), head);
-  }
+// Enters one more level of nesting at `token`.
+static void nest(Token *token) {
+  if (++nesting > MAX_NESTING)
+    error_at(token->loc, "expression nested too deeply");
+}
 
-  if (equal(head, "&")) {
-    skip();
-    return create_unary(NK_ADDR, unary(), head);
+static bool is_prefix_op(Token *token) {
+  return equal(token, "+") || equal(token, "-") || equal(token, "!") ||
+         equal(token, "++") || equal(token, "--") || equal(token, "&") ||
+         equal(token, "*") || equal(token, "sizeof");
+}
+
+// Applies prefix operator `op` to `operand`.
+static Node *create_prefix(Token *op, Node *operand) {
+  if (equal(op, "+")) return operand;
+  if (equal(op, "-")) return create_unary(NK_NEG, operand, op);
+  if (equal(op, "!")) return create_unary(NK_NOT, operand, op);
+  if (equal(op, "++")) return create_step(NK_ADD_ASSIGN, operand, op);
+  if (equal(op, "--")) return create_step(NK_SUB_ASSIGN, operand, op);
+  if (equal(op, "&")) {
+    if (operand->kind == NK_VAR) operand->var->address_taken = true;
+    return create_unary(NK_ADDR, operand, op);
   }
+  if (equal(op, "*")) return create_unary(NK_DEREF, operand, op);
+  return create_unary(NK_SIZEOF, operand, op);
+}
 
-  if (equal(head, "*")) {
+// Unary -> '+' Unary | '-' Unary | '!' Unary | '*' Unary | '&' Unary
+//        | '++' Unary | '--' Unary | 'sizeof' Unary | Postfix
+//
+// A run of prefix operators is collected first and applied from the
+// innermost out, so that the recursion depth does not grow with its
+// length. The operators are kept on the C stack, and move to the arena if
+// there are many.
+static Node *unary() {
+  Token *local_ops[64];
+  Token **ops = local_ops;
+  int cap = 64;
+  int top = 0;
+
+  while (is_prefix_op(*chain)) {
+    if (top == cap) {
+      Token **new_ops = allocate(2 * cap * sizeof(Token *));
+      memcpy(new_ops, ops, top * sizeof(Token *));
+      ops = new_ops;
+      cap *= 2;
+    }
+    nest(*chain);
+    ops[top++] = *chain;
     skip();
-    return create_unary(NK_DEREF, unary(), head);
   }
 
-  return postfix();
+  Node *node = postfix();
+  nesting -= top;
+  while (top > 0) node = create_prefix(ops[--top], node);
+  return node;
 }
 
-// Postfix -> Factor ("[" Expr "]")*
+// Postfix -> Factor ("[" Expr "]" | "++" | "--")*
 static Node *postfix() {
   Node *arr = factor();
 
   Node *curr = arr;
-  while (equal(*chain, "[")) {
+  for (;;) {
+    if (equal(*chain, "++") || equal(*chain, "--")) {
+      Token *op_token = *chain;
+      skip();
+      NodeKind kind = equal(op_token, "++") ? NK_POST_INC : NK_POST_DEC;
+      curr = create_step(kind, curr, op_token);
+      continue;
+    }
+    if (!equal(*chain, "[")) break;
+
     // x[y] is short for *(x+y)
     Token *start = *chain;
     consume("[");
+    nest(start);
     Node *index = expr();
+    nesting--;
     consume("]");
 
     Node *add_node = create_add(curr, index, start);
@@ -637,7 +874,7 @@ static Node *postfix() {
   return curr;
 }
 
-// Factor -> Number | ( Expr ) | "sizeof" Unary | Ident (Args)?
+// Factor -> Number | ( Expr ) | Ident (Args)?
 static Node *factor() {
   Token *head = *chain;
 
@@ -651,15 +888,17 @@ static Node *factor() {
     // function call
     if (equal(head->next, "(")) {
       Node *node = create_node(NK_FUNC_CALL, head->next);
-      char *func_name = strndup(head->loc, head->len);
+      char *func_name = copy_string(head->loc, head->len);
       node->func_name = func_name;
       skip();
+      nest(head->next);
       node->args = args();
+      nesting--;
       return node;
     }
 
     // referencing a variable
-    char *name = strndup(head->loc, head->len);
+    char *name = copy_string(head->loc, head->len);
     Obj *var = find_var(name);
     if (var == NULL) error_at(head->loc, "undefined variable");
     Node *node = create_var(var, head);
@@ -667,14 +906,10 @@ static Node *factor() {
     return node;
   }
 
-  if (equal(*chain, "sizeof")) {
-    skip();
-    Node *node = create_unary(NK_SIZEOF, unary(), head);
-    return node;
-  }
-
   consume("(");
+  nest(head);
   Node *node = expr();
+  nesting--;
   consume(")");
 
   return node;
@@ -709,17 +944,23 @@ static Node *args() {
 // FunctionDefinition ->
 // DeclSpec DeclaratorPrefix FuncParams CompoundStatement
 Fun *function_def() {
+  Token *ident;
   Type *type = decl_spec();
-  type = declarator_prefix(type);
+  type = declarator_prefix(type, &ident);
   type = func_params(type);
 
   // reset locals
   locals = NULL;
+  current_switch = NULL;
+  breakable = 0;
+  nesting = 0;
 
-  Fun *fun = calloc(1, sizeof(Fun));
-  fun->name = get_ident(type->ident);
+  Fun *fun = allocate(sizeof(Fun));
+  fun->name = get_ident(ident);
+  fun->token = ident;
+  if (report) report->functions++;
 
-  create_param_locals(type->param_types);
+  create_param_locals(type->params);
   fun->params = locals;
 
   fun->body = compound_stmt();
@@ -729,6 +970,7 @@ Fun *function_def() {
 }
 
 Fun *parse(Token *head) {
+  init_types();
   chain = &head;
   return program();
 }
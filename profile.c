@@ -0,0 +1,61 @@
+#include "quackcc.h"
+
+// Reader of the profiles written by programs compiled with -finstrument
+// (see runtime/profile.c), for -fprofile-use. Only the branch counts are
+// used. Branch sites are identified by the position of their if, while or
+// for keyword.
+
+static int compare_sites(const void *a, const void *b) {
+  const ProfileSite *x = a, *y = b;
+  if (x->line != y->line) return x->line < y->line ? -1 : 1;
+  if (x->col != y->col) return x->col < y->col ? -1 : 1;
+  return 0;
+}
+
+// Reads the profile at `path`. Returns NULL if it cannot be read. Profiles
+// outlive compilations, so they are allocated on the heap.
+Profile *read_profile(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) return NULL;
+
+  Profile *profile = calloc(1, sizeof(Profile));
+  if (!profile) error("out of memory");
+  profile->hash = FNV_OFFSET;
+  int cap = 0;
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    profile->hash = hash_bytes(profile->hash, line, strlen(line));
+
+    ProfileSite site;
+    if (sscanf(line, "branch %d:%d %*s %ld %ld", &site.line, &site.col,
+               &site.taken, &site.not_taken) != 4)
+      continue;
+
+    if (profile->num_sites == cap) {
+      cap = cap ? cap * 2 : 64;
+      profile->sites = realloc(profile->sites, cap * sizeof(ProfileSite));
+      if (!profile->sites) error("out of memory");
+    }
+    profile->sites[profile->num_sites++] = site;
+  }
+  fclose(fp);
+
+  qsort(profile->sites, profile->num_sites, sizeof(ProfileSite),
+        compare_sites);
+  return profile;
+}
+
+void free_profile(Profile *profile) {
+  if (!profile) return;
+  free(profile->sites);
+  free(profile);
+}
+
+// Returns the counts of the branch at `token`, or NULL if the profile has
+// none.
+ProfileSite *find_profile_site(Profile *profile, Token *token) {
+  ProfileSite key = {token->line, token->col};
+  return bsearch(&key, profile->sites, profile->num_sites,
+                 sizeof(ProfileSite), compare_sites);
+}
@@ -1,20 +1,222 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <setjmp.h>
+
+#include "libquackcc.h"
+
+#define QUACKCC_VERSION "0.1.0"
 
+typedef struct Token Token;
 typedef struct Type Type;
+typedef struct Param Param;
 typedef struct Node Node;
 
 //
-// main.c
+// arena.c
+//
+
+typedef struct ArenaBlock ArenaBlock;
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size;
+  size_t used;
+  _Alignas(16) char data[];
+};
+
+typedef struct {
+  ArenaBlock *head;
+  // blocks kept for reuse by arena_reset()
+  ArenaBlock *spare;
+  size_t allocated;
+} Arena;
+
+// a point in the allocations of an arena to go back to
+typedef struct {
+  ArenaBlock *head;
+  size_t used;
+  size_t allocated;
+} ArenaMark;
+
+extern _Thread_local Arena *current_arena;
+
+void *allocate(size_t size);
+char *copy_string(char *s, int len);
+void arena_merge(Arena *dst, Arena *src);
+void arena_reset(Arena *arena);
+ArenaMark arena_mark(Arena *arena);
+void arena_release(Arena *arena, ArenaMark mark);
+void arena_free(Arena *arena);
+
+//
+// server.c
+//
+
+int run_server(char *socket_path, char **options, int num_options);
+
+//
+// report.c
+//
+
+typedef enum {
+  PHASE_TOKENISE,
+  PHASE_PARSE,
+  PHASE_TYPE,
+  PHASE_CODEGEN,
+  PHASE_OUTPUT,
+  NUM_PHASES,
+} Phase;
+
+#define PHASE_STACK_DEPTH 8
+
+typedef struct {
+  // wall time in milliseconds and arena bytes allocated, per phase
+  double time[NUM_PHASES];
+  size_t bytes[NUM_PHASES];
+
+  // counts of created objects
+  long tokens;
+  long nodes;
+  long types;
+  long objects;
+  long functions;
+  long cache_hits;
+  long cache_misses;
+  // instructions saved by reusing values, see number_function()
+  long cse_eliminated;
+
+  // peak RSS at the end of each outermost phase, and overall
+  long phase_rss[NUM_PHASES];
+  long peak_rss;
+  size_t output_bytes;
+
+  // phases being measured, innermost last
+  Phase stack[PHASE_STACK_DEPTH];
+  int depth;
+  double last_time;
+  size_t last_bytes;
+} Report;
+
+// statistics of the compilation running on this thread, or NULL
+extern _Thread_local Report *report;
+
+void phase_begin(Phase phase);
+void phase_end(void);
+void print_report(FILE *fp, Report *r, bool time, bool mem, bool json);
+
+//
+// cache.c
+//
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t hash_bytes(uint64_t h, char *p, int len);
+Token *skip_function(Token *start);
+char *cache_key(Token *start, Token *end);
+char *cache_lookup(char *key, size_t *len);
+void cache_store(char *key, char *buf, size_t len);
+
+//
+// profile.c
+//
+
+// counts of a branch site in a -fprofile-use profile
+typedef struct {
+  int line;
+  int col;
+  // how often the condition was true and false
+  long taken;
+  long not_taken;
+} ProfileSite;
+
+typedef struct {
+  // sorted by position
+  ProfileSite *sites;
+  int num_sites;
+  // hash of the profile, for the options fingerprint
+  uint64_t hash;
+} Profile;
+
+Profile *read_profile(char *path);
+void free_profile(Profile *profile);
+ProfileSite *find_profile_site(Profile *profile, Token *token);
+
+//
+// cfg.c
+//
+
+void simplify_cfg(char **buf, size_t *len);
+
+//
+// sched.c
 //
 
+// a machine model for -mtune=<cpu>
+typedef struct {
+  char *name;
+  // instructions issued per cycle
+  int issue_width;
+  // cycles until the results of a load, a multiply and a divide are ready
+  int load_latency;
+  int mul_latency;
+  int div_latency;
+} MachineModel;
+
+MachineModel *find_machine_model(char *name);
+void schedule(char **buf, size_t *len);
+
+//
+// compile.c
+//
+
+// iterations per test for -funroll-loops, and the most -funroll-loops=<n>
+// accepts
+#define DEFAULT_UNROLL 4
+#define MAX_UNROLL 16
+
+typedef struct {
+  // number of code generation threads
+  int jobs;
+  // directory of the per-function cache, or NULL
+  char *cache_dir;
+  // compile one function at a time, see compile_streaming()
+  bool streaming;
+  // -finstrument: count function calls and branches
+  bool instrument;
+  // -fprofile-use: branch counts to lay out code by, or NULL
+  Profile *profile;
+  // -fvectorize, and remarks on which loops it vectorised
+  bool vectorize;
+  bool vectorize_report;
+  // -funroll-loops: iterations per test of unrolled loops, or 0
+  int unroll;
+  // -mtune: the machine model to schedule instructions for, or NULL
+  MachineModel *tune;
+  // -ftime-report, -fmem-report and their format
+  bool time_report;
+  bool mem_report;
+  bool report_json;
+} Options;
+
+// options of the compilation running on this thread
+extern _Thread_local Options *opt;
+
+extern _Thread_local jmp_buf *error_jmp;
+extern _Thread_local char *error_message;
+
 void error(char *fmt, ...);
+void fail(char *msg);
+char *options_fingerprint(void);
 
 //
 // tokenise.c
@@ -28,18 +230,23 @@ typedef enum {
   TK_KEYWORD,
 } TokenKind;
 
-typedef struct Token Token;
 struct Token {
   TokenKind kind;
+  int len;
   Token *next;
-  int val;
   char* loc;
-  int len;
+  int val;
+  // position in the input, counted from 1
+  int line;
+  int col;
 };
 
+extern _Thread_local char *current_input;
+
 void error_at(char *loc, char *fmt, ...);
 bool equal(Token *token, char *s);
 Token *tokenise(char *p);
+Token *tokenise_definition(char **pp);
 
 //
 // parse.c
@@ -58,15 +265,30 @@ typedef enum {
   NK_LE,
   NK_GT,
   NK_GE,
+  NK_LOGAND,
+  NK_LOGOR,
+  NK_NOT,
   NK_EXPR_STMT,
   NK_VAR,
   NK_ASSIGN,
+  // compound assignments; ++x is x += 1 and --x is x -= 1
+  NK_ADD_ASSIGN,
+  NK_SUB_ASSIGN,
+  NK_MUL_ASSIGN,
+  NK_DIV_ASSIGN,
+  // x++ and x--; the rhs is the step, scaled for pointers
+  NK_POST_INC,
+  NK_POST_DEC,
   NK_COMPOUND_STMT,
   NK_NULL_STMT,
   NK_RETURN_STMT,
   NK_IF_STMT,
   NK_WHILE_STMT,
   NK_FOR_STMT,
+  NK_SWITCH_STMT,
+  NK_CASE_STMT,
+  NK_DEFAULT_STMT,
+  NK_BREAK_STMT,
   NK_ADDR,
   NK_DEREF,
   NK_FUNC_CALL,
@@ -79,31 +301,73 @@ struct Obj {
   Type *type;
   char *name;
   int offset;
+  // whether the program takes its address with &
+  bool address_taken;
+  // set by codegen: the callee-saved register holding it, or 0 if it lives
+  // in its stack slot, its uses weighted by loop nesting, or -1 if it has
+  // to stay in memory, and how many times it has been assigned so far
+  int reg;
+  long weight;
+  int version;
 };
 
+// Nodes are allocated with only as much of the struct as their kind uses
+// (see node_size() in parse.c), so a field must only be accessed if its
+// kind has it.
 struct Node {
   NodeKind kind;
-  Node *lhs;
-  Node *rhs;
-  Node *next;
+  // NK_NUM, NK_CASE_STMT
   int val;
-  Obj *var;
-  Node *body;
-  Node *cond;
+  Node *next;
   Token *token;
   Type *type;
-  char *func_name;
-  Node *args;
+  // set by codegen: the temporaries evaluating the node takes, and whether
+  // it or a node within it puts a value in a register for reuse or takes
+  // one from there
+  int need;
+  bool has_marks;
+
+  union {
+    // NK_VAR
+    Obj *var;
+
+    // NK_FUNC_CALL
+    struct {
+      char *func_name;
+      Node *args;
+    };
+
+    // operators and statements; the statement of a case or default label
+    // is its lhs
+    struct {
+      Node *lhs;
+      Node *rhs;
+      // NK_COMPOUND_STMT, NK_WHILE_STMT, NK_FOR_STMT, NK_SWITCH_STMT
+      Node *body;
+      // NK_IF_STMT, NK_WHILE_STMT, NK_FOR_STMT, NK_SWITCH_STMT
+      Node *cond;
+    };
+  };
 };
 
 typedef struct Fun Fun;
 struct Fun {
   Fun *next;
   char *name;
+  Token *token;
   Node *body;
   Obj *params;
   Obj *locals;
   int stack_size;
+
+  // generated code, read from the cache or filled in by codegen()
+  char *output;
+  size_t output_len;
+  // key to store the code under, if it was not in the cache
+  char *cache_key;
+  // -fvectorize-report remarks, or NULL; functions read from the cache
+  // have none
+  char *remarks;
 };
 
 Fun *parse(Token *head);
@@ -128,26 +392,36 @@ struct Type {
   // pointer-to or array-of type
   Type *base;
 
-  // declaration
-  Token *ident;
-
   // array
   int array_len;
 
+  // canonical types derived from this one: the pointer to it, and the
+  // arrays of it, linked through `next_array`
+  Type *pointer_to;
+  Type *arrays;
+  Type *next_array;
+
   // function type
   Type *return_type;
-  Type *param_types;
-  Type *next_param_type;
+  Param *params;
 };
 
-extern Type *type_int;
+// function parameter
+struct Param {
+  Param *next;
+  Type *type;
+  Token *ident;
+};
+
+extern _Thread_local Type *type_int;
+
+void init_types(void);
 
 bool is_integer(Type *type);
 void add_type(Node *node);
 Type *create_pointer_to(Type *base);
 Type *create_array_of(Type *base, int len);
-Type *create_function_type(Type *return_type);
-Type *copy_type(Type *original);
+Type *create_function_type(Type *return_type, Param *params);
 
 //
 // codegen.c
@@ -0,0 +1,163 @@
+#include "quackcc.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+// Phase timing and memory statistics for -ftime-report and -fmem-report.
+//
+// Phases nest (for example, typing happens in the middle of parsing), and
+// every phase is charged only for the time and arena memory spent while it
+// is the innermost one. When no report was requested, `report` is NULL and
+// the instrumentation costs a pointer test.
+
+_Thread_local Report *report;
+
+static char *phase_names[] = {
+  [PHASE_TOKENISE] = "tokenise",
+  [PHASE_PARSE] = "parse",
+  [PHASE_TYPE] = "add_type",
+  [PHASE_CODEGEN] = "codegen",
+  [PHASE_OUTPUT] = "output",
+};
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t arena_bytes(void) {
+  return current_arena ? current_arena->allocated : 0;
+}
+
+// Charges the time and memory since the last event to the innermost phase.
+static void charge(void) {
+  double t = now_ms();
+  size_t bytes = arena_bytes();
+  if (report->depth > 0) {
+    Phase phase = report->stack[report->depth - 1];
+    report->time[phase] += t - report->last_time;
+    report->bytes[phase] += bytes - report->last_bytes;
+  }
+  report->last_time = t;
+  report->last_bytes = bytes;
+}
+
+void phase_begin(Phase phase) {
+  if (!report) return;
+  charge();
+  assert(report->depth < PHASE_STACK_DEPTH);
+  report->stack[report->depth++] = phase;
+}
+
+static long peak_rss_bytes(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  return usage.ru_maxrss * 1024L;
+#endif
+}
+
+void phase_end(void) {
+  if (!report) return;
+  charge();
+  report->depth--;
+
+  // sampled for outermost phases only, which run once per compilation
+  if (report->depth == 0) {
+    Phase phase = report->stack[0];
+    report->phase_rss[phase] = peak_rss_bytes();
+  }
+}
+
+static void print_text(FILE *fp, Report *r, bool time, bool mem) {
+  double total_time = 0;
+  size_t total_bytes = 0;
+  for (int i = 0; i < NUM_PHASES; i++) {
+    total_time += r->time[i];
+    total_bytes += r->bytes[i];
+  }
+
+  if (time) {
+    fprintf(fp, "quackcc time report:\n");
+    fprintf(fp, "  %-10s %12s %7s\n", "phase", "wall (ms)", "%");
+    for (int i = 0; i < NUM_PHASES; i++)
+      fprintf(fp, "  %-10s %12.3f %6.1f%%\n", phase_names[i], r->time[i],
+              total_time > 0 ? 100 * r->time[i] / total_time : 0);
+    fprintf(fp, "  %-10s %12.3f\n", "total", total_time);
+  }
+
+  if (mem) {
+    fprintf(fp, "quackcc memory report:\n");
+    fprintf(fp, "  %-14s %12ld\n", "tokens", r->tokens);
+    fprintf(fp, "  %-14s %12ld\n", "nodes", r->nodes);
+    fprintf(fp, "  %-14s %12ld\n", "types", r->types);
+    fprintf(fp, "  %-14s %12ld\n", "objects", r->objects);
+    fprintf(fp, "  %-14s %12ld\n", "functions", r->functions);
+    fprintf(fp, "  %-14s %12ld\n", "cache hits", r->cache_hits);
+    fprintf(fp, "  %-14s %12ld\n", "cache misses", r->cache_misses);
+    fprintf(fp, "  %-14s %12ld\n", "cse eliminated", r->cse_eliminated);
+    fprintf(fp, "  bytes allocated:\n");
+    for (int i = 0; i < NUM_PHASES; i++)
+      fprintf(fp, "    %-12s %12zu\n", phase_names[i], r->bytes[i]);
+    fprintf(fp, "    %-12s %12zu\n", "total", total_bytes);
+    fprintf(fp, "  peak RSS after phase:\n");
+    for (int i = 0; i < NUM_PHASES; i++)
+      if (r->phase_rss[i])
+        fprintf(fp, "    %-12s %12ld\n", phase_names[i], r->phase_rss[i]);
+    fprintf(fp, "  %-14s %12ld\n", "peak RSS", r->peak_rss);
+    fprintf(fp, "  %-14s %12zu\n", "output bytes", r->output_bytes);
+  }
+}
+
+static void print_json(FILE *fp, Report *r, bool time, bool mem) {
+  fprintf(fp, "{");
+  if (time) {
+    fprintf(fp, "\"time_ms\": {");
+    double total = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+      fprintf(fp, "\"%s\": %.6f, ", phase_names[i], r->time[i]);
+      total += r->time[i];
+    }
+    fprintf(fp, "\"total\": %.6f}", total);
+  }
+  if (mem) {
+    if (time) fprintf(fp, ", ");
+    fprintf(fp, "\"memory\": {");
+    fprintf(fp, "\"tokens\": %ld, ", r->tokens);
+    fprintf(fp, "\"nodes\": %ld, ", r->nodes);
+    fprintf(fp, "\"types\": %ld, ", r->types);
+    fprintf(fp, "\"objects\": %ld, ", r->objects);
+    fprintf(fp, "\"functions\": %ld, ", r->functions);
+    fprintf(fp, "\"cache_hits\": %ld, ", r->cache_hits);
+    fprintf(fp, "\"cache_misses\": %ld, ", r->cache_misses);
+    fprintf(fp, "\"cse_eliminated\": %ld, ", r->cse_eliminated);
+    fprintf(fp, "\"bytes_allocated\": {");
+    size_t total = 0;
+    for (int i = 0; i < NUM_PHASES; i++) {
+      fprintf(fp, "\"%s\": %zu, ", phase_names[i], r->bytes[i]);
+      total += r->bytes[i];
+    }
+    fprintf(fp, "\"total\": %zu}, ", total);
+    fprintf(fp, "\"peak_rss_after_phase\": {");
+    char *sep = "";
+    for (int i = 0; i < NUM_PHASES; i++) {
+      if (!r->phase_rss[i]) continue;
+      fprintf(fp, "%s\"%s\": %ld", sep, phase_names[i], r->phase_rss[i]);
+      sep = ", ";
+    }
+    fprintf(fp, "}, ");
+    fprintf(fp, "\"peak_rss\": %ld, ", r->peak_rss);
+    fprintf(fp, "\"output_bytes\": %zu}", r->output_bytes);
+  }
+  fprintf(fp, "}\n");
+}
+
+// Prints the report of the compilation that just finished to `fp`.
+void print_report(FILE *fp, Report *r, bool time, bool mem, bool json) {
+  r->peak_rss = peak_rss_bytes();
+  if (json) print_json(fp, r, time, mem);
+  else print_text(fp, r, time, mem);
+}
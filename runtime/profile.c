@@ -0,0 +1,73 @@
+// Runtime support for programs compiled with quackcc -finstrument. Link it
+// into the program:
+//
+//   quackcc -finstrument '<program>' > prog.s
+//   cc -o prog prog.s runtime/profile.c
+//
+// At exit, the program writes its counts to the file named by
+// $QUACKCC_PROFILE, or to quackcc.prof. Each line of the profile is one of
+//
+//   function <name> <line>:<col> <calls>
+//   branch <line>:<col> <if|while|for> <true> <false>
+//
+// where a branch line gives how often the condition of the statement at
+// <line>:<col> was true and false, and belongs to the function above it.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  int line;
+  int col;
+  int kind;
+} QccProfSite;
+
+// Emitted by quackcc for every function, see gen_profile_data() in
+// codegen.c.
+typedef struct QccProfFunction QccProfFunction;
+struct QccProfFunction {
+  QccProfFunction *next;
+  const char *name;
+  long line;
+  long col;
+  long num_sites;
+  // calls, then (true, false) for every site
+  long *counters;
+  QccProfSite *sites;
+};
+
+static QccProfFunction *functions;
+static QccProfFunction **last = &functions;
+
+static char *kind_names[] = {"if", "while", "for"};
+
+static void write_profile(void) {
+  char *path = getenv("QUACKCC_PROFILE");
+  if (!path) path = "quackcc.prof";
+
+  FILE *fp = fopen(path, "w");
+  if (!fp) {
+    fprintf(stderr, "quackcc: cannot write profile %s\n", path);
+    return;
+  }
+
+  for (QccProfFunction *fn = functions; fn; fn = fn->next) {
+    fprintf(fp, "function %s %ld:%ld %ld\n", fn->name, fn->line, fn->col,
+            fn->counters[0]);
+    for (long i = 0; i < fn->num_sites; i++) {
+      QccProfSite *site = &fn->sites[i];
+      fprintf(fp, "branch %d:%d %s %ld %ld\n", site->line, site->col,
+              kind_names[site->kind], fn->counters[1 + 2 * i],
+              fn->counters[2 + 2 * i]);
+    }
+  }
+
+  fclose(fp);
+}
+
+// Called by a constructor of every instrumented function, in source order.
+void qcc_prof_register(QccProfFunction *fn) {
+  if (!functions) atexit(write_profile);
+  *last = fn;
+  last = &fn->next;
+}
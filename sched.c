@@ -0,0 +1,393 @@
+#include "quackcc.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+// Instruction scheduling for -mtune=<cpu>
+//
+// Code is generated a node at a time, so a load is usually followed right
+// away by the instruction using its value, and independent computations
+// are not interleaved. With a machine model, the instructions of every
+// basic block of a generated function are reordered by a list scheduler.
+// It simulates issuing up to `issue_width` instructions per cycle, each
+// once the values it reads are ready, and prefers the instruction with the
+// longest chain of latencies after it. Every dependence is kept: on
+// registers, including the flags, and on memory, where stores stay in
+// order with the loads and stores that may access the same bytes. Labels,
+// branches, calls and directives end blocks and never move.
+//
+// The scheduler works on the generated text, which only holds the
+// instructions listed below; any other line ends a block.
+
+static MachineModel models[] = {
+  {"cortex-a53", 2, 3, 4, 20},
+  {"cortex-a72", 3, 4, 3, 20},
+  {"apple-m1", 8, 4, 3, 9},
+};
+
+// Returns the model named `name`, or NULL if there is none.
+MachineModel *find_machine_model(char *name) {
+  int len = sizeof(models) / sizeof(MachineModel);
+  for (int i = 0; i < len; i++)
+    if (strcmp(models[i].name, name) == 0) return &models[i];
+  return NULL;
+}
+
+// registers: x0 to x30, sp, v0 to v31 and the flags
+#define NUM_REGS 65
+#define REG_SP 31
+#define REG_V0 32
+#define REG_FLAGS 64
+
+// most instructions scheduled together; longer blocks are split
+#define SCHED_WINDOW 64
+#define MAX_DEFS 4
+#define MAX_USES 8
+
+typedef struct {
+  char *line;
+  int len;
+  int defs[MAX_DEFS];
+  int num_defs;
+  int uses[MAX_USES];
+  int num_uses;
+  int latency;
+
+  // a load or store of `size` bytes at `offset` from register `base`, as
+  // it was numbered `version` times it had been written in the block, or
+  // at an unknown address if `base` is -1. Instructions moving sp are
+  // ordered with all memory accesses, as if they stored anywhere.
+  bool load;
+  bool store;
+  int base;
+  int version;
+  long offset;
+  int size;
+
+  // the longest chain of latencies from the instruction to the end of the
+  // block, the predecessors not issued yet, and the first cycle it can
+  // issue in
+  int height;
+  int num_preds;
+  int ready;
+  bool done;
+} Insn;
+
+typedef struct {
+  Insn insns[SCHED_WINDOW];
+  int num_insns;
+  // latencies of the dependences between instructions, or -1
+  signed char edges[SCHED_WINDOW][SCHED_WINDOW];
+  // how many times each register has been written in the block
+  int versions[NUM_REGS];
+} Block;
+
+static bool is_ident_char(char c) {
+  return isalnum(c) || c == '_' || c == '.' || c == '@';
+}
+
+// Returns the number of the register named by the `len` bytes at `p`, or
+// -1 if they do not name one. The zero register is not a register here.
+static int reg_number(char *p, int len) {
+  if (len == 2 && !strncmp(p, "sp", 2)) return REG_SP;
+  if (len == 2 && !strncmp(p, "fp", 2)) return 29;
+  if (len == 2 && !strncmp(p, "lr", 2)) return 30;
+  if (len < 2 || len > 3 || !strchr("xwvqds", p[0])) return -1;
+
+  int n = 0;
+  for (int i = 1; i < len; i++) {
+    if (!isdigit(p[i])) return -1;
+    n = n * 10 + p[i] - '0';
+  }
+  if (p[0] == 'x' || p[0] == 'w') return n <= 30 ? n : -1;
+  return n <= 31 ? REG_V0 + n : -1;
+}
+
+// Adds the registers named in operand `p` to `regs`, up to `max` of them.
+static void scan_regs(char *p, char *end, int *regs, int *num, int max) {
+  while (p < end) {
+    if (!is_ident_char(*p)) {
+      p++;
+      continue;
+    }
+    char *start = p;
+    while (p < end && is_ident_char(*p)) p++;
+    // v3.2d names v3; labels start with a dot or an underscore
+    char *q = start;
+    while (q < p && *q != '.') q++;
+    int reg = isalpha(*start) ? reg_number(start, q - start) : -1;
+    if (reg >= 0 && *num < max) regs[(*num)++] = reg;
+  }
+}
+
+typedef struct {
+  char *start;
+  char *end;
+} Operand;
+
+// Splits the operands of an instruction at the commas outside brackets.
+// Returns how many there are, or -1 if there are too many.
+static int split_operands(char *p, char *end, Operand *ops, int max) {
+  int n = 0;
+  int level = 0;
+  while (p < end && *p == ' ') p++;
+  if (p == end) return 0;
+
+  ops[0].start = p;
+  for (; p < end; p++) {
+    if (*p == '[') level++;
+    if (*p == ']') level--;
+    if (*p == ',' && level == 0) {
+      ops[n++].end = p;
+      if (n == max) return -1;
+      p++;
+      while (p < end && *p == ' ') p++;
+      ops[n].start = p;
+      p--;
+    }
+  }
+  ops[n++].end = end;
+  return n;
+}
+
+static bool is_one_of(char *p, int len, char **names) {
+  for (; *names; names++)
+    if ((int)strlen(*names) == len && !strncmp(p, *names, len)) return true;
+  return false;
+}
+
+static char *alu_insns[] = {
+  "mov", "movi", "add", "sub", "neg", "mvn", "adr", "adrp", "dup", "fmov",
+  "addp", "cmeq", "cmgt", "cmge", NULL,
+};
+static char *select_insns[] = {
+  "cset", "csel", "csinc", "csneg", "cinc", NULL,
+};
+static char *compare_insns[] = {"cmp", "cmn", NULL};
+static char *load_insns[] = {"ldr", "ldrsw", "ldp", NULL};
+static char *store_insns[] = {"str", "stp", NULL};
+
+// Describes the address of memory operand `op` of `insn`, and adds the
+// registers it reads. `writeback` tells whether the instruction writes
+// the address back to its base.
+static void parse_address(Block *b, Insn *insn, Operand *op, bool writeback) {
+  scan_regs(op->start, op->end, insn->uses, &insn->num_uses, MAX_USES);
+
+  char *p = op->start + 1;
+  char *base_end = p;
+  while (base_end < op->end && is_ident_char(*base_end)) base_end++;
+  insn->base = reg_number(p, base_end - p);
+  insn->offset = 0;
+
+  // [base], [base, #offset] or [base, offset], and otherwise an index
+  p = base_end;
+  if (*p == ',') {
+    p++;
+    while (*p == ' ') p++;
+    if (*p == '#') p++;
+    char *num_end;
+    insn->offset = strtol(p, &num_end, 10);
+    if (num_end == p || *num_end != ']') insn->base = -1;
+  }
+
+  if (insn->base >= 0) insn->version = b->versions[insn->base];
+  if (writeback && insn->base >= 0 && insn->num_defs < MAX_DEFS)
+    insn->defs[insn->num_defs++] = insn->base;
+}
+
+// Parses a load or store. A pair has two registers before the address,
+// and writeback is either pre-indexed, [base, #offset]!, or post-indexed,
+// [base], #offset.
+static bool parse_memory_insn(Block *b, Insn *insn, char *name,
+                              Operand *ops, int num_ops) {
+  bool pair = name[2] == 'p';
+  int mem = pair ? 2 : 1;
+  if (num_ops < mem + 1 || num_ops > mem + 2 || *ops[mem].start != '[')
+    return false;
+
+  insn->load = name[0] == 'l';
+  insn->store = !insn->load;
+  if (pair || *ops[0].start == 'q') insn->size = 16;
+  else if (!strncmp(name, "ldrsw", 5)) insn->size = 4;
+  else insn->size = 8;
+  if (insn->load) insn->latency = opt->tune->load_latency;
+
+  for (int i = 0; i < mem; i++) {
+    if (insn->load)
+      scan_regs(ops[i].start, ops[i].end, insn->defs, &insn->num_defs,
+                MAX_DEFS);
+    else
+      scan_regs(ops[i].start, ops[i].end, insn->uses, &insn->num_uses,
+                MAX_USES);
+  }
+  bool writeback = ops[mem].end[-1] == '!' || num_ops == mem + 2;
+  parse_address(b, insn, &ops[mem], writeback);
+  return true;
+}
+
+// Parses the instruction on `line` into `insn`. Returns false if it is not
+// one that can be moved.
+static bool parse_insn(Block *b, Insn *insn, char *line, int len) {
+  *insn = (Insn){line, len, .latency = 1};
+  char *end = line + len;
+  while (end > line && isspace(end[-1])) end--;
+  if (end - line < 5 || strncmp(line, "    ", 4) || !isalpha(line[4]))
+    return false;
+
+  char *name = line + 4;
+  char *name_end = name;
+  while (name_end < end && isalpha(*name_end)) name_end++;
+  int name_len = name_end - name;
+  if (name_end < end && *name_end != ' ') return false;
+
+  Operand ops[6];
+  int num_ops = split_operands(name_end, end, ops, 6);
+  if (num_ops < 1) return false;
+
+  if (is_one_of(name, name_len, load_insns) ||
+      is_one_of(name, name_len, store_insns)) {
+    if (!parse_memory_insn(b, insn, name, ops, num_ops)) return false;
+  } else {
+    // the first operand is written and the others are read, except by
+    // comparisons, which write the flags
+    bool compare = is_one_of(name, name_len, compare_insns);
+    if (is_one_of(name, name_len, select_insns))
+      insn->uses[insn->num_uses++] = REG_FLAGS;
+    else if (name_len == 3 && !strncmp(name, "mul", 3))
+      insn->latency = opt->tune->mul_latency;
+    else if (name_len == 4 && !strncmp(name, "sdiv", 4))
+      insn->latency = opt->tune->div_latency;
+    else if (!compare && !is_one_of(name, name_len, alu_insns))
+      return false;
+
+    if (compare)
+      insn->defs[insn->num_defs++] = REG_FLAGS;
+    else
+      scan_regs(ops[0].start, ops[0].end, insn->defs, &insn->num_defs,
+                MAX_DEFS);
+    for (int i = compare ? 0 : 1; i < num_ops; i++)
+      scan_regs(ops[i].start, ops[i].end, insn->uses, &insn->num_uses,
+                MAX_USES);
+  }
+
+  // moving sp orders an instruction with every memory access
+  for (int i = 0; i < insn->num_defs; i++) {
+    if (insn->defs[i] == REG_SP) {
+      insn->store = true;
+      insn->base = -1;
+    }
+  }
+  return true;
+}
+
+static bool has_reg(int *regs, int num, int reg) {
+  for (int i = 0; i < num; i++)
+    if (regs[i] == reg) return true;
+  return false;
+}
+
+static bool overlaps(int *a, int num_a, int *b, int num_b) {
+  for (int i = 0; i < num_a; i++)
+    if (has_reg(b, num_b, a[i])) return true;
+  return false;
+}
+
+static bool may_alias(Insn *a, Insn *b) {
+  if (a->base < 0 || a->base != b->base || a->version != b->version)
+    return true;
+  return a->offset < b->offset + b->size && b->offset < a->offset + a->size;
+}
+
+// Returns the least number of cycles between issuing `a` and the later
+// `b`, or -1 if `b` does not depend on `a`.
+static int dependence(Insn *a, Insn *b) {
+  int latency = -1;
+  if (overlaps(a->defs, a->num_defs, b->uses, b->num_uses))
+    latency = a->latency;
+  if (overlaps(a->defs, a->num_defs, b->defs, b->num_defs))
+    latency = MAX(latency, 1);
+  if (overlaps(a->uses, a->num_uses, b->defs, b->num_defs))
+    latency = MAX(latency, 0);
+
+  if ((a->store && (b->load || b->store)) || (a->load && b->store)) {
+    if (may_alias(a, b)) latency = MAX(latency, a->store ? 1 : 0);
+  }
+  return latency;
+}
+
+// Writes the instructions of `b` to `out` in the order they issue in.
+static void flush(Block *b, FILE *out) {
+  int n = b->num_insns;
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < i; j++) {
+      int latency = dependence(&b->insns[j], &b->insns[i]);
+      b->edges[j][i] = latency;
+      if (latency >= 0) b->insns[i].num_preds++;
+    }
+  }
+
+  for (int i = n - 1; i >= 0; i--) {
+    Insn *insn = &b->insns[i];
+    insn->height = insn->latency;
+    for (int j = i + 1; j < n; j++)
+      if (b->edges[i][j] >= 0)
+        insn->height = MAX(insn->height, b->edges[i][j] + b->insns[j].height);
+  }
+
+  int width = opt->tune->issue_width;
+  for (int cycle = 0, issued = 0; issued < n; cycle++) {
+    for (int slot = 0; slot < width; slot++) {
+      Insn *best = NULL;
+      for (int i = 0; i < n; i++) {
+        Insn *insn = &b->insns[i];
+        if (insn->done || insn->num_preds || insn->ready > cycle) continue;
+        if (!best || insn->height > best->height) best = insn;
+      }
+      if (!best) break;
+
+      fwrite(best->line, 1, best->len, out);
+      best->done = true;
+      issued++;
+      int i = best - b->insns;
+      for (int j = i + 1; j < n; j++) {
+        if (b->edges[i][j] < 0) continue;
+        b->insns[j].num_preds--;
+        b->insns[j].ready = MAX(b->insns[j].ready, cycle + b->edges[i][j]);
+      }
+    }
+  }
+
+  b->num_insns = 0;
+  memset(b->versions, 0, sizeof(b->versions));
+}
+
+// Schedules the generated code in `*buf`, replacing it.
+void schedule(char **buf, size_t *len) {
+  char *new_buf;
+  size_t new_len;
+  FILE *out = open_memstream(&new_buf, &new_len);
+  Block *b = calloc(1, sizeof(Block));
+  if (!b) error("out of memory");
+
+  char *end = *buf + *len;
+  for (char *line = *buf; line < end;) {
+    char *next = memchr(line, '\n', end - line);
+    next = next ? next + 1 : end;
+
+    Insn *insn = &b->insns[b->num_insns];
+    if (parse_insn(b, insn, line, next - line)) {
+      for (int i = 0; i < insn->num_defs; i++) b->versions[insn->defs[i]]++;
+      if (++b->num_insns == SCHED_WINDOW) flush(b, out);
+    } else {
+      flush(b, out);
+      fwrite(line, 1, next - line, out);
+    }
+    line = next;
+  }
+  flush(b, out);
+
+  fclose(out);
+  free(b);
+  free(*buf);
+  *buf = new_buf;
+  *len = new_len;
+}
@@ -0,0 +1,203 @@
+#include "quackcc.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Compile server.
+//
+// Every request is a header line followed by a payload:
+//
+//   <length>\n<source>   compile `length` bytes of source code
+//   stats\n              report the server's counters
+//
+// and every response has the same shape:
+//
+//   ok <length>\n<assembly>
+//   error <length>\n<diagnostic>
+//   stats <length>\n<counters>
+//
+// The server reads requests from stdin and writes responses to stdout, or
+// serves each connection of a Unix socket on its own thread. Every
+// connection reuses one compiler context for all its requests.
+
+typedef struct {
+  pthread_mutex_t lock;
+  struct timespec start;
+  long requests;
+  long failures;
+  long bytes_in;
+  long bytes_out;
+  // latencies in nanoseconds
+  long total_latency;
+  long min_latency;
+  long max_latency;
+} Stats;
+
+static Stats stats = {PTHREAD_MUTEX_INITIALIZER};
+
+static char **server_options;
+static int server_num_options;
+
+static long elapsed_ns(struct timespec *start, struct timespec *end) {
+  return (end->tv_sec - start->tv_sec) * 1000000000L +
+         (end->tv_nsec - start->tv_nsec);
+}
+
+static void record(long in, long out, long latency, bool failed) {
+  pthread_mutex_lock(&stats.lock);
+  stats.requests++;
+  stats.failures += failed;
+  stats.bytes_in += in;
+  stats.bytes_out += out;
+  stats.total_latency += latency;
+  if (stats.requests == 1 || latency < stats.min_latency)
+    stats.min_latency = latency;
+  if (latency > stats.max_latency) stats.max_latency = latency;
+  pthread_mutex_unlock(&stats.lock);
+}
+
+static void respond(FILE *out, char *kind, const char *buf, size_t len) {
+  fprintf(out, "%s %zu\n", kind, len);
+  fwrite(buf, 1, len, out);
+  fflush(out);
+}
+
+static void respond_stats(FILE *out) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  char *buf;
+  size_t len;
+  FILE *fp = open_memstream(&buf, &len);
+
+  pthread_mutex_lock(&stats.lock);
+  double uptime = elapsed_ns(&stats.start, &now) / 1e9;
+  long n = stats.requests;
+  fprintf(fp, "requests %ld\n", n);
+  fprintf(fp, "failures %ld\n", stats.failures);
+  fprintf(fp, "bytes_in %ld\n", stats.bytes_in);
+  fprintf(fp, "bytes_out %ld\n", stats.bytes_out);
+  fprintf(fp, "uptime_s %.3f\n", uptime);
+  fprintf(fp, "requests_per_s %.1f\n", uptime > 0 ? n / uptime : 0);
+  fprintf(fp, "latency_avg_us %.1f\n", n ? stats.total_latency / 1e3 / n : 0);
+  fprintf(fp, "latency_min_us %.1f\n", stats.min_latency / 1e3);
+  fprintf(fp, "latency_max_us %.1f\n", stats.max_latency / 1e3);
+  pthread_mutex_unlock(&stats.lock);
+
+  fclose(fp);
+  respond(out, "stats", buf, len);
+  free(buf);
+}
+
+// Serves requests until the input is exhausted. Returns -1 on a malformed
+// request.
+static int serve(FILE *in, FILE *out) {
+  QuackCC *cc = quackcc_new();
+  if (!cc) return -1;
+  for (int i = 0; i < server_num_options; i++)
+    quackcc_set_option(cc, server_options[i]);
+
+  char *src = NULL;
+  size_t cap = 0;
+  char header[64];
+  int ret = 0;
+
+  while (fgets(header, sizeof(header), in)) {
+    if (strcmp(header, "stats\n") == 0) {
+      respond_stats(out);
+      continue;
+    }
+
+    char *end;
+    long len = strtol(header, &end, 10);
+    if (end == header || *end != '\n' || len < 0) {
+      char *msg = "malformed request header\n";
+      respond(out, "error", msg, strlen(msg));
+      ret = -1;
+      break;
+    }
+
+    if ((size_t)len > cap) {
+      cap = len;
+      src = realloc(src, cap);
+      if (!src) error("out of memory");
+    }
+    if (fread(src, 1, len, in) != (size_t)len) {
+      ret = -1;
+      break;
+    }
+
+    struct timespec start, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    char *asm_buf;
+    size_t asm_len;
+    bool failed = quackcc_compile(cc, src, len, &asm_buf, &asm_len) != 0;
+    if (failed) {
+      const char *msg = quackcc_error(cc);
+      asm_len = strlen(msg);
+      respond(out, "error", msg, asm_len);
+    } else {
+      respond(out, "ok", asm_buf, asm_len);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    record(len, asm_len, elapsed_ns(&start, &end_time), failed);
+  }
+
+  free(src);
+  quackcc_free(cc);
+  return ret;
+}
+
+static void *serve_connection(void *arg) {
+  int fd = (int)(long)arg;
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  if (in && out) serve(in, out);
+  if (in) fclose(in);
+  if (out) fclose(out);
+  return NULL;
+}
+
+static int listen_on(char *path) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) error("cannot create socket");
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 64))
+    error("cannot listen on %s", path);
+  return fd;
+}
+
+// Runs the compile server. Every compiler context it creates is configured
+// with `options`.
+int run_server(char *socket_path, char **options, int num_options) {
+  server_options = options;
+  server_num_options = num_options;
+  clock_gettime(CLOCK_MONOTONIC, &stats.start);
+
+  if (!socket_path) return serve(stdin, stdout) ? 1 : 0;
+
+  int listen_fd = listen_on(socket_path);
+  for (;;) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, (void *)(long)fd)) {
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+}
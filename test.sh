@@ -13,17 +13,117 @@ assert() {
   expected="$1"
   input="$2"
 
-  ./quackcc "$input" > tmp.s || exit
+  ./quackcc $flags "$input" > tmp.s || exit
+  gcc -o tmp tmp.s tmp2.o $link
+  ./tmp
+  actual="$?"
+
+  if [ "$actual" = "$expected" ]; then
+    echo "${flags:+$flags }$input => $actual"
+  else
+    echo "${flags:+$flags }$input => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# Checks that the options $1 and $2 generate the same code for $3.
+assert_same() {
+  ./quackcc $1 "$3" > tmp.s || exit
+  ./quackcc $2 "$3" > tmp1.s || exit
+
+  if cmp -s tmp.s tmp1.s; then
+    echo "$1 = $2 $3 => same"
+  else
+    echo "$1 = $2 $3 => different code"
+    exit 1
+  fi
+}
+
+# Checks that the compile server answers a request with a syntax error with
+# an error, and then generates the same code for $1 as quackcc does.
+assert_server() {
+  bad='int main() { return 1 +; }'
+  ./quackcc "$1" > tmp.s || exit
+  { printf 'ok %d\n' $(wc -c < tmp.s); cat tmp.s; } > tmp1.s
+  { printf '%d\n%s' ${#bad} "$bad"; printf '%d\n%s' ${#1} "$1"; } |
+    ./quackcc --server > tmp.out || exit
+
+  if head -1 tmp.out | grep -q '^error ' &&
+     tail -c $(wc -c < tmp1.s) tmp.out | cmp -s - tmp1.s; then
+    echo "--server $1 => same"
+  else
+    echo "--server $1 => unexpected response"
+    exit 1
+  fi
+}
+
+# Checks that quackcc with the options $1 writes a line matching $2 to
+# stderr for $3.
+assert_report() {
+  ./quackcc $1 "$3" > /dev/null 2> tmp.err || exit
+
+  if grep -q -- "$2" tmp.err; then
+    echo "$1 $3 => $2"
+  else
+    echo "$1 $3 => $2 expected, but got"
+    cat tmp.err
+    exit 1
+  fi
+}
+
+# Like assert, but passes the program on stdin, for programs too long for
+# argv, and only shows its length.
+assert_stdin() {
+  expected="$1"
+  input="$2"
+
+  echo "$input" | ./quackcc $flags - > tmp.s || exit
   gcc -o tmp tmp.s tmp2.o
   ./tmp
   actual="$?"
 
   if [ "$actual" = "$expected" ]; then
-    echo "$input => $actual"
+    echo "${#input} bytes on stdin => $actual"
+  else
+    echo "${#input} bytes on stdin => $expected expected, but got $actual"
+    exit 1
+  fi
+}
+
+# Checks that quackcc fails to compile $2, passed on stdin, with an error
+# matching $1 rather than crashing.
+assert_stdin_error() {
+  echo "$2" | ./quackcc - > /dev/null 2> tmp.err
+  actual="$?"
+
+  if [ "$actual" = 1 ] && grep -q -- "$1" tmp.err; then
+    echo "${#2} bytes on stdin => $1"
+  else
+    echo "${#2} bytes on stdin => $1 expected, but got exit code $actual"
+    exit 1
+  fi
+}
+
+# Checks that the profile written by the last program has a line matching
+# $1.
+assert_profile() {
+  if grep -q -- "$1" tmp.prof; then
+    echo "tmp.prof => $1"
   else
-    echo "$input => $expected expected, but got $actual"
+    echo "tmp.prof => $1 expected, but got"
+    cat tmp.prof
+    exit 1
+  fi
+}
+
+# Checks that quackcc rejects the option $1.
+assert_rejected() {
+  if ./quackcc "$1" 'int main() { return 0; }' > /dev/null 2> tmp.err ||
+     ! grep -q 'invalid argument' tmp.err; then
+    echo "$1 => rejected expected"
     exit 1
   fi
+  echo "$1 => rejected"
 }
 
 assert 0 'int main() { return 0; }'
@@ -163,4 +263,177 @@ assert 8 'int main() { int x[3][4]; return sizeof(**x + 1); }'
 assert 8 'int main() { int x=1; return sizeof(x=2); }'
 assert 1 'int main() { int x=1; sizeof(x=2); return x; }'
 
+assert 20 'int main() { int x=2; int y=0; switch (x) { case 1: y=10; break; case 2: y=20; break; case 3: y=30; break; } return y; }'
+assert 50 'int main() { int x=4; int y=0; switch (x) { case 1: y=10; break; case 2: y=20; break; default: y=50; } return y; }'
+assert 0 'int main() { int x=4; int y=0; switch (x) { case 1: y=10; break; case 2: y=20; break; } return y; }'
+assert 7 'int main() { int x=1; int y=0; switch (x) { case 1: y=y+3; case 2: y=y+4; break; case 3: y=y+5; } return y; }'
+assert 11 'int main() { int x=3; int y=0; switch (x) { case 1: case 2: y=10; break; case 3: case 4: y=11; break; } return y; }'
+assert 4 'int main() { int s=0; int i; for (i=0; i<4; i=i+1) switch (i) { case 0: s=s+1; break; case 1: s=s+2; break; default: s=s+i-2; } return s; }'
+assert 33 'int main() { int x=-3; switch (x) { case -3: return 33; case 5: return 5; case 1000: return 10; } return 0; }'
+assert 9 'int main() { int x=9; int y=0; switch (x) { case 1: y=1; break; case 3: y=3; break; case 5: y=5; break; case 7: y=7; break; case 9: y=9; break; case 11: y=11; break; } return y; }'
+assert 42 'int main() { int x=500; int y=0; switch (x) { case 1: y=1; break; case 30: y=3; break; case 500: y=42; break; case 7000: y=7; break; case 90000: y=9; break; } return y; }'
+assert 3 'int main() { int x=2; int y=0; switch (x) { case 1: y=1; break; case 2: switch (y) { case 0: y=3; break; default: y=4; } break; default: y=5; } return y; }'
+assert 5 'int main() { int x=1; int y=0; switch (x+1) { default: y=5; break; case 1: y=1; } return y; }'
+assert 4 'int main() { int y=0; switch (2*3-1) { case 2+3: y=4; break; case 6: y=6; } return y; }'
+assert 10 'int main() { int i=0; while (1) { i=i+1; if (i==10) break; } return i; }'
+assert 5 'int main() { int i; int j; int s=0; for (i=0; i<5; i=i+1) for (j=0; j<100; j=j+1) { if (j==1) break; s=s+1; } return s; }'
+assert 3 'int main() { int breaks=3; int cases=breaks; return cases; }'
+
+assert 1 'int main() { return 2 && 3; }'
+assert 0 'int main() { return 2 && 0; }'
+assert 0 'int main() { return 0 && 1; }'
+assert 1 'int main() { return 0 || 4; }'
+assert 0 'int main() { return 0 || 0; }'
+assert 1 'int main() { return !0; }'
+assert 0 'int main() { return !5; }'
+assert 1 'int main() { int x=3; return !(x < 2); }'
+assert 1 'int main() { return 1 || 0 && 0; }'
+assert 3 'int main() { int x=3; int y=0; 0 && (y=1); 1 || (y=2); return x+y; }'
+assert 2 'int main() { int x=0; 1 && (x=2); 0 || (x=x); return x; }'
+assert 7 'int main() { int a[3]; int i=0; a[0]=1; a[1]=2; a[2]=0; while (i < 3 && a[i] != 0) i=i+1; return i+5; }'
+assert 4 'int main() { int i; int n=0; for (i=0; i<10; i=i+1) if (i < 2 || i > 7) n=n+1; return n; }'
+assert 5 'int main() { int x=5; if (!(x == 3) && !(x > 9)) return x; return 0; }'
+assert 6 'int main() { int x=0; while (!x) x=6; return x; }'
+assert 1 'int main() { int x=2; switch (1) { case 0 || 1: x=1; } return x; }'
+
+assert 7 'int main() { int x=3; x+=4; return x; }'
+assert 5 'int main() { int x=8; x-=3; return x; }'
+assert 6 'int main() { int x=3; x*=2; return x; }'
+assert 3 'int main() { int x=7; x/=2; return x; }'
+assert 9 'int main() { int x=3; int y; y = x += 6; return y; }'
+assert 8 'int main() { int x=3; int y=2; x += y += 3; return x; }'
+assert 4 'int main() { int i=3; ++i; return i; }'
+assert 2 'int main() { int i=3; --i; return i; }'
+assert 4 'int main() { int i=3; return ++i; }'
+assert 3 'int main() { int i=3; return i++; }'
+assert 4 'int main() { int i=3; i++; return i; }'
+assert 3 'int main() { int i=3; return i--; }'
+assert 2 'int main() { int i=3; i--; return i; }'
+assert 7 'int main() { int i=3; int j = i++ + i; return j; }'
+assert 10 'int main() { int a[3]; int i; for (i=0; i<3; i++) a[i]=i; a[2]+=8; return a[2]; }'
+assert 6 'int main() { int a[2][3]; int i=1; int j=2; a[i][j]=2; a[i][j]*=3; return a[i][j]; }'
+assert 5 'int main() { int a[3]; int i=0; a[0]=5; a[1]=7; return a[i++]; }'
+assert 7 'int main() { int a[3]; int i=0; a[0]=5; a[1]=7; return a[++i]; }'
+assert 2 'int main() { int a[3]; int i=0; a[0]=1; a[i++]++; return a[0]+i-1; }'
+assert 7 'int main() { int a[3]; int *p=a; a[0]=5; a[1]=7; p++; return *p; }'
+assert 5 'int main() { int a[3]; int *p=a+1; a[0]=5; a[1]=7; --p; return *p; }'
+assert 9 'int main() { int a[3]; int *p=a; a[2]=9; p+=2; return *p; }'
+assert 5 'int main() { int a[3]; int *p=a+2; a[0]=5; p-=2; return *p; }'
+assert 7 'int main() { int a[3]; int *p=a; a[0]=5; a[1]=7; return *++p; }'
+assert 5 'int main() { int a[3]; int *p=a; a[0]=5; a[1]=7; return *p++; }'
+assert 2 'int main() { int a[3]; int *p=a; p++; p++; return p-a; }'
+assert 45 'int main() { int i; int s=0; for (i=0; i<10; i++) s+=i; return s; }'
+assert 55 'int main() { int i=10; int s=0; while (i > 0) { s+=i; i--; } return s; }'
+assert 20 'int main() { int i; int s=0; for (i=0; i<10; i+=2) s+=i; return s; }'
+assert 12 'int main() { int x=2; int y=3; x += y * 2 + 4; return x; }'
+assert 1 'int main() { int x=3; if (x++ == 3 && x == 4) return 1; return 0; }'
+
+assert 62 'int f(int x) { int a=x*2; int b=a+1; return a+b; } int main() { int a=5; int b=7; int c=f(a)+f(b); return a+b+c; }'
+assert 91 'int main() { int a=1; int b=2; int c=3; int d=4; int e=5; int f=6; int g=7; int h=8; int i=9; int j=10; int k=11; int l=12; int m=add(a, l); return a+b+c+d+e+f+g+h+i+j+k+l+m; }'
+assert 15 'int main() { int x=3; int y=4; int *p=&x; *p = y + add(x, y); return x + y; }'
+assert 55 'int sum(int n) { int s=n; if (n == 0) return 0; return s + sum(n-1); } int main() { return sum(10); }'
+
+assert 11 'int main() { int a[3][4]; int i=1; int j=2; int s=0; a[i][j]=5; if (a[i][j] > 3) s = a[i][j] + 1; else s = a[i][j] - 1; return s + a[i][j]; }'
+assert 20 'int main() { int a[4]; int i=2; a[i]=3; a[i] = a[i] + add(a[i], 4); return a[i] + a[i]; }'
+assert 30 'int main() { int a[4][4]; int i=2; int j=1; int x=0; a[2][1]=4; a[1][1]=6; if (x) x = a[i][j]; else x = a[j][j]; return x + a[i][j] * a[j][j]; }'
+assert 21 'int main() { int a[4]; int *p=a; int i=1; a[i]=2; p[1]=7; return a[i] + a[i]*2; }'
+assert 18 'int main() { int a[4]; int i=1; int s=0; a[1]=3; a[2]=5; s = a[i+1] * 2; i = i + 1; return s + a[i+1-1] + a[i-1]; }'
+assert 230 'int main() { int v6 = 100; int v8 = 1; int v9 = 10; int i0; int i1; int i2; int a0[4]; int a1[3][5]; int a2[8]; for (i0 = 0; i0 < 4; i0 = i0 + 1) a0[i0] = i0 * 1000 + 5; for (i0 = 0; i0 < 3; i0 = i0 + 1) for (i1 = 0; i1 < 5; i1 = i1 + 1) a1[i0][i1] = i0 - i1 * 100; for (i0 = 0; i0 < 8; i0 = i0 + 1) a2[i0] = i0 * 255 + 1000; i1 = 0; i2 = 0; a1[1][1] = (a1[1][3] + (a2[5] - 10)) - ((10 < 10) - (a1[1][2] - 2)); for (; i2 < 7; i2 = i2 + 1) { if (a1[0][3] - v6) { for (; i1 < 1; i1 = i1 + 1) { a1[i1][i1]; } for (i1 = 0; i1 <= 3; i1 = i1 + 1) { a0[i1] = a0[i1] - a1[1][0]; } for (i1 = 0; i1 < 4; i1 = i1 + 1) { a0[i1] + a0[i1]; } } if (v8) v9 = a2[4]; v9 = a1[2][1] - v9; } return a0[1]; }'
+assert 72 'int main() { int a[3][5]; int i; int j; int s=0; for (i=0; i<3; i=i+1) for (j=0; j<5; j=j+1) a[i][j]=i*10+j; a[2][0] = 1; for (i=0; i<4; i=i+1) { s = s + a[2][0]; for (j=0; j<2; j=j+1) { a[0][4] = a[0][4] + 1; s = s + a[0][4]; } } return s; }'
+
+assert 57 'int main() { int a[8]; int i; int *p=a+2; for (i=0; i<8; i=i+1) a[i]=i*3; return a[7] + p[3] + *(p+1) + *(a+4); }'
+assert 73 'int main() { int a[40]; int i; int *p=a+39; for (i=0; i<40; i=i+1) a[i]=i; return p[-38] + a[35] + *(p-2); }'
+assert 13 'int main() { int a[5000]; int i; for (i=0; i<5000; i=i+1000) a[i]=i/1000; a[4999]=9; return a[4000] + a[4999] + a[0]; }'
+assert 35 'int main() { int a[3][5]; int i=2; int j=3; int *p; a[i][j]=7; a[1][4]=4; p=&a[i][j]; *p = *p * 5; return a[2][3]; }'
+
+assert 10 'int main() { int x=3; int y=0; if (x > 2) y = 10; else y = 20; return y; }'
+assert 20 'int main() { int x=1; int y=0; if (x > 2) y = 10; else y = 20; return y; }'
+assert 5 'int main() { int x=5; int m=x; if (x < 3) m = 3; return m; }'
+assert 3 'int main() { int x=0; int y=1; if (y) x = add(1, 2); else x = 9; return x; }'
+assert 8 'int main() { int x=4; int y=0; if (x > 1) if (x < 5) y = x * 2; else y = x; return y; }'
+assert 0 'int main() { int a[2]; int i=5; int v=0; a[0]=4; if (i < 2) v = a[i]; return v; }'
+assert 7 'int main() { int a[3]; int i=1; a[1]=2; if (a[i] == 2) a[i] = 7; else a[i] = 1; return a[1]; }'
+
+assert 3 'int main() { int x=3; if (x) {} else {} if (x > 1) ; else x = 9; return x; }'
+assert 7 'int main() { int x=0; if (x) { if (x > 1) x = 5; } else { if (x < 1) x = 7; } return x; }'
+assert 3 'int main() { int i=0; int s=0; while (i < 5) { if (i == 3) break; s += i; i++; } return s; }'
+assert 2 'int main() { int x=2; while (0) x = 9; for (;0;) x = 8; if (0) x = 7; return x; }'
+assert 10 'int main() { int i; int s=0; for (i=0; i<3; i++) { switch (i) { case 0: break; case 1: s += 10; break; default: break; } } return s; }'
+assert 4 'int main() { int x=1; int y=2; if (x) { if (y) { if (x == y) return 1; } } return 4; }'
+assert 6 'int main() { int i; int j; int s=0; for (i=0; i<3; i++) for (j=0; j<3; j++) { if (j > i) break; s += 1; } return s; }'
+
+prog='int f(int x) { return x+1; } int g(int x) { return f(x)*2; } int h(int x) { return g(x)-f(x); } int main() { return h(4) + g(1) + fib(9); } int fib(int x) { if (x<=1) return 1; return fib(x-1) + fib(x-2); }'
+flags=-j1 assert 64 "$prog"
+flags=-j4 assert 64 "$prog"
+assert_same -j1 -j4 "$prog"
+assert_server "$prog"
+
+rm -rf tmp.cache
+flags=-fcache-dir=tmp.cache assert 64 "$prog"
+flags=-fcache-dir=tmp.cache assert 64 "$prog"
+assert_same '' -fcache-dir=tmp.cache "$prog"
+rm -rf tmp.cache
+assert_report '-fcache-dir=tmp.cache -fmem-report' 'cache misses  *5$' "$prog"
+assert_report '-fcache-dir=tmp.cache -fmem-report' 'cache hits  *5$' "$prog"
+assert_report '-fcache-dir=tmp.cache -fmem-report -finstrument' 'cache misses  *5$' "$prog"
+assert_report '-fcache-dir=tmp.cache -fmem-report -fvectorize' 'cache misses  *5$' "$prog"
+rm -rf tmp.cache
+
+assert_report -ftime-report '^  total  *[0-9.]*$' "$prog"
+assert_report -fmem-report '^  functions  *5$' "$prog"
+assert_report '-ftime-report -freport-format=json' '^{"time_ms": {.*"total": [0-9.]*}}$' "$prog"
+assert_report '-fmem-report -freport-format=json' '^{"memory": {.*"functions": 5, ' "$prog"
+assert_report '-ftime-report -fmem-report -freport-format=json' '^{"time_ms": {.*}, "memory": {' "$prog"
+
+flags=-fstreaming assert 64 "$prog"
+flags=-fstreaming assert 8 'int main() { int x=3; int y=5; return x+y; } int unused() { int a[4]; return a[1]; }'
+assert_same '' -fstreaming "$prog"
+
+prog='int main() { int i; int s=0; for (i=0; i<10; i=i+1) if (i < 3) s=s+i; else s=s+1; return s; }'
+QUACKCC_PROFILE=tmp.prof flags=-finstrument link=runtime/profile.c assert 10 "$prog"
+assert_profile '^function main 1:5 1$'
+assert_profile '^branch 1:[0-9]* for 10 1$'
+assert_profile '^branch 1:[0-9]* if 3 7$'
+flags=-fprofile-use=tmp.prof assert 10 "$prog"
+prog='int main() { int i; int s=0; for (i=0; i<100; i=i+1) { if (i == 99) s=s+50; s=s+1; } return s; }'
+QUACKCC_PROFILE=tmp.prof flags=-finstrument link=runtime/profile.c assert 150 "$prog"
+assert_profile '^branch 1:[0-9]* if 1 99$'
+flags=-fprofile-use=tmp.prof assert 150 "$prog"
+assert_rejected -fprofile-use=tmp.missing
+
+prog='int main() { int a[7]; int b[7]; int i; int s=0; for (i=0; i<7; i=i+1) { a[i]=i; b[i]=i*2; } for (i=0; i<7; i=i+1) { a[i] = a[i] + b[i]; s = s + a[i] - 1; } return s; }'
+flags=-fvectorize assert 56 "$prog"
+assert_report '-fvectorize -fvectorize-report' '^1:94: loop vectorised$' "$prog"
+assert_report '-fvectorize -fvectorize-report' '^1:50: loop not vectorised: uses the induction variable as a value$' "$prog"
+flags=-fvectorize assert 246 'int main() { int a[6]; int b[6]; int i; int s=0; for (i=0; i<6; i=i+1) { a[i]=i; b[i]=i*2; } for (i=0; i<6; i=i+1) s = s + (a[i] + (b[i] + (a[i] + (b[i] + (a[i] + (b[i] + (a[i] + (b[i] + (a[i] + (b[i] + (a[i] + 1))))))))))); return s; }'
+prog='int main() { int a[10]; int i; int s=0; for (i=0; i<10; i=i+1) a[i]=i; for (i=0; i<10; i=i+1) s = s + a[i]; return s; }'
+QUACKCC_PROFILE=tmp.prof flags='-finstrument -fvectorize' link=runtime/profile.c assert 45 "$prog"
+assert_profile '^branch 1:72 for 10 1$'
+
+prog='int main() { int a[10]; int i; int s=0; for (i=0; i<10; i=i+1) a[i]=i; for (i=0; i<10; i=i+1) s = s + a[i]; i=0; while (i <= 6) { s = s + i; i = i + 1; } return s; }'
+flags=-funroll-loops assert 66 "$prog"
+flags=-funroll-loops=2 assert 66 "$prog"
+flags=-funroll-loops=3 assert 66 "$prog"
+flags=-funroll-loops=16 assert 66 "$prog"
+assert_rejected -funroll-loops=1
+assert_rejected -funroll-loops=17
+
+prog='int main() { int a[4][4]; int i; int j; int s=0; for (i=0; i<4; i++) for (j=0; j<4; j++) a[i][j] = i*4 + j; for (i=0; i<4; i++) s = s + a[i][i] * a[3-i][i] - a[i][3]; return s + add(s, a[1][2]); }'
+flags=-mtune=apple-m1 assert 234 "$prog"
+flags=-mtune=cortex-a53 assert 234 "$prog"
+flags=-mtune=cortex-a72 assert 234 "$prog"
+assert_same '' -mtune=generic "$prog"
+assert_same '' '-mtune=apple-m1 -mtune=generic' "$prog"
+assert_rejected -mtune=pentium4
+
+prog="int main() { int a=1; return $(printf 'a+%.0s' $(seq 99999))a; }"
+assert_stdin 160 "$prog"
+assert_stdin 1 "int main() { return $(printf -- '- %.0s' $(seq 4096))1; }"
+assert_stdin 7 "int main() { int a[2]; a[1]=7; return $(printf '(%.0s' $(seq 4000))a[1]$(printf ')%.0s' $(seq 4000)); }"
+assert_stdin_error 'nested too deeply' "int main() { return $(printf -- '-!%.0s' $(seq 100000))1; }"
+assert_stdin_error 'nested too deeply' "int main() { return $(printf '(%.0s' $(seq 20000))1$(printf ')%.0s' $(seq 20000)); }"
+
+gcc -std=c11 -pthread -o tmp.api test/api.c libquackcc.a || exit
+./tmp.api || exit
+
 echo OK
@@ -0,0 +1,53 @@
+// Checks the library API, run by test.sh: one context compiles a program,
+// fails on a syntax error, and then compiles the program again. The error
+// unwinds out of the parser with longjmp, and the second compile reuses the
+// arena of the first, so it must give the same code as the first did.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../libquackcc.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+static void check(bool ok, char *what) {
+  printf("api: %s => %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) failures++;
+}
+
+static int compile(QuackCC *cc, char *src, char **out, size_t *len) {
+  return quackcc_compile(cc, src, strlen(src), out, len);
+}
+
+int main() {
+  char *prog = "int f(int x) { return x*2; } int main() { return f(21); }";
+  char *out;
+  size_t len;
+
+  QuackCC *cc = quackcc_new();
+  check(cc != NULL, "quackcc_new");
+  check(quackcc_set_option(cc, "-j2") == 0, "-j2 is accepted");
+  check(quackcc_set_option(cc, "-fno-such-option") == -1,
+        "an unknown option is rejected");
+
+  check(compile(cc, prog, &out, &len) == 0, "first compile");
+  char *first = strndup(out, len);
+  size_t first_len = len;
+  check(strstr(first, "_main:") != NULL, "first compile generates main");
+
+  check(compile(cc, "int main() { return 1 +; }", &out, &len) == -1,
+        "a syntax error fails");
+  const char *msg = quackcc_error(cc);
+  check(msg && strstr(msg, "expected"), "the syntax error is reported");
+
+  check(compile(cc, prog, &out, &len) == 0, "compile after the error");
+  check(len == first_len && memcmp(out, first, len) == 0,
+        "compile after the error generates the same code");
+
+  free(first);
+  quackcc_free(cc);
+  return failures != 0;
+}
@@ -0,0 +1,22 @@
+.global _main
+
+_main:
+    stp fp, lr, [sp, #-16]!
+    mov fp, sp
+    sub sp, sp, #16
+    mov x0, #7
+    str x0, [sp, #-16]!
+    mov x0, #1
+    mov x1, #8
+    mul x0, x0, x1
+    add x1, fp, #-16
+    add x0, x1, x0
+    mov x12, x0
+    ldr x1, [sp], #16
+    str x1, [x0]
+    mov x0, x12
+    ldr x0, [x0]
+    mov sp, fp
+    ldp fp, lr, [sp], #16
+    ret
+
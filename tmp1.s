@@ -0,0 +1,109 @@
+.global _main
+
+_main:
+    stp fp, lr, [sp, #-16]!
+    mov fp, sp
+    sub sp, sp, #160
+    str x19, [fp, #-8]
+    str x20, [fp, #-16]
+    str x21, [fp, #-24]
+    mov x0, #0
+    mov x21, x0
+    mov x0, #0
+    mov x19, x0
+.L1.main:
+    mov x0, x19
+    cmp x0, #4
+    bge .L2.main
+    mov x0, #0
+    mov x20, x0
+.L3.main:
+    mov x0, x20
+    cmp x0, #4
+    bge .L4.main
+    mov x0, x19
+    mov x1, #4
+    mul x0, x0, x1
+    mov x1, x20
+    add x0, x0, x1
+    str x0, [sp, #-16]!
+    mov x0, x19
+    mov x1, #32
+    mul x0, x0, x1
+    add x1, fp, #-152
+    add x0, x1, x0
+    str x0, [sp, #-16]!
+    mov x0, x20
+    mov x1, x0
+    ldr x0, [sp], #16
+    ldr x2, [sp], #16
+    str x2, [x0, x1, lsl #3]
+    add x20, x20, #1
+    b .L3.main
+.L4.main:
+    add x19, x19, #1
+    b .L1.main
+.L2.main:
+    mov x0, #0
+    mov x19, x0
+.L5.main:
+    mov x0, x19
+    cmp x0, #4
+    bge .L6.main
+    mov x0, x21
+    mov x3, x0
+    mov x0, x19
+    mov x1, #32
+    mul x0, x0, x1
+    add x1, fp, #-152
+    add x0, x1, x0
+    mov x12, x0
+    str x0, [sp, #-16]!
+    mov x0, x19
+    mov x1, x0
+    ldr x0, [sp], #16
+    ldr x0, [x0, x1, lsl #3]
+    mov x4, x0
+    mov x0, #3
+    mov x1, x19
+    sub x0, x0, x1
+    mov x1, #32
+    mul x0, x0, x1
+    add x1, fp, #-152
+    add x0, x1, x0
+    str x0, [sp, #-16]!
+    mov x0, x19
+    mov x1, x0
+    ldr x0, [sp], #16
+    ldr x0, [x0, x1, lsl #3]
+    mul x0, x4, x0
+    add x0, x3, x0
+    mov x3, x0
+    mov x0, x12
+    ldr x0, [x0, #24]
+    sub x0, x3, x0
+    mov x21, x0
+    add x19, x19, #1
+    b .L5.main
+.L6.main:
+    mov x0, x21
+    str x0, [sp, #-16]!
+    mov x0, #1
+    mov x1, #32
+    mul x0, x0, x1
+    add x1, fp, #-152
+    add x0, x1, x0
+    ldr x0, [x0, #16]
+    str x0, [sp, #-16]!
+    ldr x1, [sp], #16
+    ldr x0, [sp], #16
+    bl _add
+    mov x1, x21
+    add x0, x1, x0
+    ldr x19, [fp, #-8]
+    ldr x20, [fp, #-16]
+    ldr x21, [fp, #-24]
+    mov sp, fp
+    ldp fp, lr, [sp], #16
+    ret
+
@@ -1,15 +1,25 @@
 #include "quackcc.h"
 
-static char *current_input;
+_Thread_local char *current_input;
+
+// the line being tokenised, and where it starts
+static _Thread_local int line;
+static _Thread_local char *line_start;
 
 static void verror_at(char *loc, char *fmt, va_list ap) {
+  char *msg;
+  size_t len;
+  FILE *fp = open_memstream(&msg, &len);
+
   int pos = loc - current_input;
-  fprintf(stderr, "%s\n", current_input);
-  fprintf(stderr, "%*s", pos, ""); // print pos spaces.
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, ap);
-  fprintf(stderr, "\n");
-  exit(1);
+  fprintf(fp, "%s\n", current_input);
+  fprintf(fp, "%*s", pos, ""); // print pos spaces.
+  fprintf(fp, "^ ");
+  vfprintf(fp, fmt, ap);
+  fprintf(fp, "\n");
+
+  fclose(fp);
+  fail(msg);
 }
 
 void error_at(char *loc, char *fmt, ...) {
@@ -19,10 +29,13 @@ void error_at(char *loc, char *fmt, ...) {
 }
 
 static Token *create_token(TokenKind kind, char *start, char *end) {
-  Token *token = calloc(1, sizeof(Token));
+  Token *token = allocate(sizeof(Token));
+  if (report) report->tokens++;
   token->kind = kind;
   token->loc = start;
   token->len = end - start;
+  token->line = line;
+  token->col = start - line_start + 1;
   return token;
 }
 
@@ -32,7 +45,11 @@ static bool startswith(char *p, char *q) {
 
 static int get_punct_len(char *p) {
   if (startswith(p, "==") || startswith(p, "!=") ||
-      startswith(p, "<=") || startswith(p, ">="))
+      startswith(p, "<=") || startswith(p, ">=") ||
+      startswith(p, "&&") || startswith(p, "||") ||
+      startswith(p, "+=") || startswith(p, "-=") ||
+      startswith(p, "*=") || startswith(p, "/=") ||
+      startswith(p, "++") || startswith(p, "--"))
     return 2;
 
   if (ispunct(*p)) return 1;
@@ -52,20 +69,29 @@ static int get_ident_len(char *c) {
 
 static int get_keyword_len(char *p) {
   static char *keywords[] = {
-    "return", "if", "else", "for", "while", "int", "sizeof"
+    "return", "if", "else", "for", "while", "int", "sizeof", "switch",
+    "case", "default", "break"
   };
   int len = sizeof(keywords) / sizeof(char*);
 
+  // a keyword is a whole identifier; `breakfast` is not `break`
+  int ident_len = get_ident_len(p);
   for (int i = 0; i < len; i++) {
     char *keyword = keywords[i];
-    if (startswith(p, keyword)) return strlen(keyword);
+    if (!strncmp(p, keyword, ident_len) && !keyword[ident_len])
+      return ident_len;
   }
 
   return 0;
 }
 
 static Token *get_next_token(char **pp) {
-  while (isspace(**pp)) (*pp)++;
+  for (; isspace(**pp); (*pp)++) {
+    if (**pp == '\n') {
+      line++;
+      line_start = *pp + 1;
+    }
+  }
 
   if (**pp == '\0') return create_token(TK_EOF, *pp, *pp + 1);
 
@@ -102,6 +128,8 @@ static Token *get_next_token(char **pp) {
 
 Token *tokenise(char *p) {
   current_input = p;
+  line = 1;
+  line_start = p;
   Token head = {};
   Token *curr = &head;
   while (curr->kind != TK_EOF) {
@@ -112,6 +140,33 @@ Token *tokenise(char *p) {
   return head.next;
 }
 
+// Tokenises the top-level definition at `*pp`, up to the "}" that closes
+// its body, and advances `*pp` past it. The tokens end with an EOF token of
+// their own, so they can be parsed without the rest of the input. At the
+// end of the input, returns just the EOF token.
+Token *tokenise_definition(char **pp) {
+  if (*pp == current_input) {
+    line = 1;
+    line_start = *pp;
+  }
+
+  Token head = {0};
+  Token *curr = &head;
+  int level = 0;
+  while (curr->kind != TK_EOF) {
+    Token *next_token = get_next_token(pp);
+    curr->next = next_token;
+    curr = next_token;
+
+    if (equal(curr, "{")) level++;
+    if (equal(curr, "}") && --level == 0) {
+      curr->next = create_token(TK_EOF, *pp, *pp);
+      break;
+    }
+  }
+  return head.next;
+}
+
 bool equal(Token *token, char *s) {
-  return memcmp(token->loc, s, token->len) == 0 && s[token->len] == '\0';
+  return strncmp(token->loc, s, token->len) == 0 && s[token->len] == '\0';
 }
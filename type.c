@@ -1,44 +1,60 @@
 #include "quackcc.h"
 
-Type *type_int = &(Type){TYK_INT, 8};
+// Types are canonical: every pointer and array type is created once, the
+// first time it is asked for, and cached on its base type. So two types are
+// the same exactly if they are the same pointer. The types live in the arena
+// of the compilation, which is why `int` itself is per thread.
+_Thread_local Type *type_int;
+
+static Type *create_type(TypeKind kind, int size) {
+  Type *type = allocate(sizeof(Type));
+  if (report) report->types++;
+  type->kind = kind;
+  type->size = size;
+  return type;
+}
+
+// Starts a new set of types for the compilation about to run on this
+// thread.
+void init_types(void) {
+  type_int = create_type(TYK_INT, 8);
+}
 
 bool is_integer(Type *type) {
   return type->kind == TYK_INT;
 }
 
 Type *create_pointer_to(Type *base) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TYK_PTR;
-  type->base = base;
-  type->size = 8;
-  return type;
+  if (!base->pointer_to) {
+    Type *type = create_type(TYK_PTR, 8);
+    type->base = base;
+    base->pointer_to = type;
+  }
+  return base->pointer_to;
 }
 
 Type *create_array_of(Type *base, int len) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TYK_ARRAY;
+  for (Type *type = base->arrays; type; type = type->next_array)
+    if (type->array_len == len) return type;
+
+  Type *type = create_type(TYK_ARRAY, base->size * len);
   type->array_len = len;
   type->base = base;
-  type->size = base->size * len;
+  type->next_array = base->arrays;
+  base->arrays = type;
   return type;
 }
 
-Type *create_function_type(Type *return_type) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TYK_FUN;
+// Function types are not canonical; there is one per function definition.
+Type *create_function_type(Type *return_type, Param *params) {
+  Type *type = create_type(TYK_FUN, 0);
   type->return_type = return_type;
+  type->params = params;
   return type;
 }
 
-void add_type(Node *node) {
-  if (!node || node->type) return;
-  
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  for (Node *n = node->body; n; n = n->next) add_type(n);
-  for (Node *n = node->args; n; n = n->next) add_type(n);
-  
+// Sets the type of `node` from the types of its operands.
+static void set_type(Node *node) {
   switch (node->kind) {
   case NK_ADD:
   case NK_SUB:
@@ -48,7 +64,14 @@ void add_type(Node *node) {
     node->type = node->lhs->type;
     return;
   case NK_ASSIGN:
-    if (node->lhs->type->kind == TYK_ARRAY)
+  case NK_ADD_ASSIGN:
+  case NK_SUB_ASSIGN:
+  case NK_MUL_ASSIGN:
+  case NK_DIV_ASSIGN:
+  case NK_POST_INC:
+  case NK_POST_DEC:
+    if ((node->lhs->kind != NK_VAR && node->lhs->kind != NK_DEREF) ||
+        node->lhs->type->kind == TYK_ARRAY)
       error_at(node->token->loc, "not an lvalue");
     node->type = node->lhs->type;
     return;
@@ -58,6 +81,9 @@ void add_type(Node *node) {
   case NK_LE:
   case NK_GT:
   case NK_GE:
+  case NK_LOGAND:
+  case NK_LOGOR:
+  case NK_NOT:
   case NK_NUM:
   case NK_FUNC_CALL:
     node->type = type_int;
@@ -85,8 +111,82 @@ void add_type(Node *node) {
   }
 }
 
-Type *copy_type(Type *original) {
-  Type *copy = calloc(1, sizeof(Type));
-  *copy = *original;
-  return copy;
+// add_type walks the tree with an explicit stack instead of recursion, so
+// that very deep expressions do not overflow the C stack. The stack starts
+// out on the C stack and moves to the arena if it grows.
+typedef enum {
+  VISIT,  // push the operands of a node, then finish it
+  FINISH, // set the type of a node whose operands are typed
+  LIST,   // visit a node and its `next` siblings, in order
+} Step;
+
+typedef struct {
+  Step step;
+  Node *node;
+} Frame;
+
+void add_type(Node *node) {
+  if (!node || node->type) return;
+
+  Frame local_frames[64];
+  Frame *frames = local_frames;
+  int cap = 64;
+  int top = 0;
+  Frame frame = {VISIT, node};
+
+  for (;;) {
+    // room for the five frames pushed below
+    if (top + 5 > cap) {
+      Frame *new_frames = allocate(2 * cap * sizeof(Frame));
+      memcpy(new_frames, frames, top * sizeof(Frame));
+      frames = new_frames;
+      cap *= 2;
+    }
+
+    Node *n = frame.node;
+    switch (frame.step) {
+    case VISIT:
+      if (!n || n->type) break;
+      // operands are visited in the order lhs, rhs, cond, body, args
+      frames[top++] = (Frame){FINISH, n};
+      switch (n->kind) {
+      case NK_NUM:
+      case NK_VAR:
+      case NK_NULL_STMT:
+      case NK_BREAK_STMT:
+        break;
+      case NK_FUNC_CALL:
+        frames[top++] = (Frame){LIST, n->args};
+        break;
+      case NK_COMPOUND_STMT:
+        frames[top++] = (Frame){LIST, n->body};
+        break;
+      case NK_IF_STMT:
+      case NK_WHILE_STMT:
+      case NK_FOR_STMT:
+      case NK_SWITCH_STMT:
+        frames[top++] = (Frame){LIST, n->body};
+        frames[top++] = (Frame){VISIT, n->cond};
+        frames[top++] = (Frame){VISIT, n->rhs};
+        frames[top++] = (Frame){VISIT, n->lhs};
+        break;
+      default:
+        frames[top++] = (Frame){VISIT, n->rhs};
+        frames[top++] = (Frame){VISIT, n->lhs};
+        break;
+      }
+      break;
+    case LIST:
+      if (!n) break;
+      frames[top++] = (Frame){LIST, n->next};
+      frame = (Frame){VISIT, n};
+      continue;
+    case FINISH:
+      set_type(n);
+      break;
+    }
+
+    if (top == 0) return;
+    frame = frames[--top];
+  }
 }